@@ -21,15 +21,22 @@
 #include <freertos/queue.h>
 #include <driver/adc.h>
 #include <driver/i2s.h>
+#include <esp_adc_cal.h>
 #include <nvs_flash.h>
 #include <esp_task_wdt.h>
 
+#include <stdlib.h>
+#include <math.h>
 #include <string.h>
 
 #include "periodic.h"
 #include "errors.h"
+#include "command.h"
 #include "adc.h"
 #include "hci.h"
+#include "fmt.h"
+#include "timebase.h"
+#include "adc_kernel.h"
 
 int adc_channel[ADC_COUNT] =
 {
@@ -39,6 +46,10 @@ int adc_channel[ADC_COUNT] =
 
 const int ADC_BITS = 12;
 
+/* Sample rates of the I2S built-in ADC mode */
+const uint32_t ADC_I2S_MIN_RATE = 2496;
+const uint32_t ADC_I2S_MAX_RATE = 1333328;
+
 struct
 {
 	uint16_t v1x_0_2v;
@@ -50,33 +61,360 @@ struct
 	uint8_t flags; /* initialized, raw, amp, timestamp */
 } adc_config[ADC_COUNT];
 
+/*
+ * Input voltage in millivolts of every raw value, built from calibration for
+ * the gain in use, 8 KiB per table. Tables are rebuilt from the HCI thread while the ADC
+ * thread converts, so a table is built in the spare one and published by
+ * swapping pointers. The replaced table becomes the spare, readers only hold
+ * a table for one conversion.
+ */
+#define ADC_LUT_SIZE 4096
+#define ADC_DEFAULT_VREF 1100 /* mV, used if not in eFuse */
+static esp_adc_cal_characteristics_t adc_characteristics;
+static int16_t adc_lut_tables[ADC_COUNT + 1][ADC_LUT_SIZE];
+static const int16_t *adc_lut[ADC_COUNT];
+static int16_t *adc_lut_spare;
+
+/* Filters of single conversions and streaming, set by config filter */
+static struct adc_filter_config adc_filter_config[ADC_COUNT];
+
 const uint8_t ADC_FLAG_INIT = 1 << 0;
 const uint8_t ADC_FLAG_RAW =  1 << 1;
 const uint8_t ADC_FLAG_AMP10X = 1 << 2;
 
 static QueueHandle_t i2s_queue;
+
+/* Binary trig records hold at most this many values to fit in a frame */
+#define ADC_TRIG_RECORD 512
+static uint32_t adc_trig_rate = 1; /* Per ADC */
+/* Trigger mode used by the next trig, set by the trig edge/window/pulse commands */
+static struct adc_trig adc_trig_mode = { .mode = ADC_TRIG_ANY };
+
+/*
+ * Segmented capture, the trigger is re-armed until count segments of m + n
+ * values are captured. Set by the trig segments command.
+ */
+enum adc_capture_mode
+{
+	ADC_CAPTURE_STREAM = 0, /* Send segments while capturing */
+	ADC_CAPTURE_BATCH, /* Send all segments when done */
+	ADC_CAPTURE_AVERAGE /* Send the average of all segments when done */
+};
+
+static struct
+{
+	uint16_t count;
+	uint32_t holdoff; /* Values to skip after a segment before searching */
+	uint8_t mode;
+} adc_segment_config = { 1, 0, ADC_CAPTURE_STREAM };
+
+/*
+ * Scan of both ADCs, the pattern table of the digital controller alternates
+ * between their channels in one I2S stream. Set by the trig scan command.
+ */
+static struct
+{
+	uint8_t on;
+	uint8_t adc; /* Triggering ADC */
+} adc_scan_config = { 0, 0 };
+
+/*
+ * ADCs captured by the running trig, 2 when scanning. DMA buffers then hold
+ * adc_trig_block values of each ADC as pairs, ADC0 first.
+ */
+static uint8_t adc_trig_channels = 1;
+static int adc_trig_block = 1024;
+
+struct adc_segment
+{
+	uint64_t time; /* Time of trigger value */
+	uint32_t start; /* First value captured, above 0 if history was missing */
+};
+
+/*
+ * Min, max envelope of captures instead of values when bucket is not 0, set
+ * by the trig envelope command. Pairs are sent in records of
+ * ADC_ENVELOPE_RECORD as they are filled.
+ */
+#define ADC_ENVELOPE_RECORD 256
+static uint16_t adc_envelope_config;
+
+static struct
+{
+	uint16_t bucket;
+	struct adc_envelope state[ADC_COUNT];
+	uint32_t start[ADC_COUNT]; /* Index of first value of pairs */
+	int count[ADC_COUNT]; /* Pairs not yet sent */
+	uint16_t pairs[ADC_COUNT][2 * ADC_ENVELOPE_RECORD];
+} adc_envelope;
+
+/*
+ * Trig history, a ring of DMA buffers allocated when trig is armed. Each
+ * buffer is read from I2S and unpacked in place, head is the latest. Values
+ * are sent from the buffers, a buffer still being sent is swapped with one of
+ * the spares after the ring before it is read into again.
+ */
+#define ADC_RING_SPARES 4
+
+struct adc_block
+{
+	uint64_t time; /* When the DMA buffer was received */
+	uint32_t refs; /* Chunks of values not yet sent */
+	union
+	{
+		uint32_t words[512];
+		uint16_t values[1024];
+	};
+};
+
+static struct
+{
+	struct adc_block **blocks;
+	int count;
+	int head;
+	int filled; /* Buffers received since armed, at most count */
+} adc_ring;
+
+static struct
+{
+	uint16_t count;
+	uint16_t current;
+	uint8_t mode;
+	uint32_t trigger; /* Index of trigger value in a segment, m */
+	uint32_t len; /* Values per segment, m + n */
+	struct adc_segment *segments;
+	/*
+	 * Arena of count * channels * len values in batch mode, channels * len
+	 * averages when averaging
+	 */
+	uint16_t *values;
+	uint32_t *sums; /* channels * len sums of segments when averaging */
+	uint32_t refs; /* Chunks of values not yet sent */
+	uint8_t aborted; /* Sending is stopped by trig off */
+} adc_capture;
 static QueueHandle_t cmd_queue;
+static int adc_tx_slot = -1;
 
 struct cmd_event
 {
 	uint8_t event;
+	int32_t tag;
 	union
 	{
 		struct
 		{
 			uint32_t sample_rate;
-			uint16_t m, n;
-			uint8_t value;
+			uint32_t m;
+			uint16_t n;
+			struct adc_trig trigger;
+			uint16_t segments;
+			uint32_t holdoff;
+			uint8_t mode;
+			uint16_t envelope;
+			uint8_t scan;
+			uint8_t scan_adc;
 		} trig;
+		struct
+		{
+			uint8_t adc;
+			uint32_t rate;
+			uint32_t decimation;
+			uint16_t average;
+		} periodic;
+		struct
+		{
+			uint8_t adc;
+			uint32_t rate; /* 0 = highest the link sustains */
+			struct adc_filter_config filter;
+		} stream;
+		struct
+		{
+			uint32_t rate;
+			uint32_t samples;
+		} measure;
+		struct
+		{
+			uint16_t segment;
+			uint32_t start;
+			uint32_t len;
+		} zoom;
+		struct
+		{
+			uint32_t rate;
+			uint16_t points;
+			uint8_t window;
+			uint16_t frames;
+			uint8_t peaks;
+		} spectrum;
 	};
 };
 
 enum
 {
 	EVENT_CMD_TRIG_OFF = 0,
-	EVENT_CMD_TRIG
+	EVENT_CMD_TRIG,
+	EVENT_CMD_PERIODIC_OFF,
+	EVENT_CMD_PERIODIC,
+	EVENT_CMD_STREAM_OFF,
+	EVENT_CMD_STREAM,
+	EVENT_CMD_MEASURE,
+	EVENT_CMD_SPECTRUM,
+	EVENT_CMD_ZOOM
 };
 
+/*
+ * Periodic logging, every value is the average of the last average samples
+ * of decimation samples from I2S. Values are sent in batches.
+ */
+#define ADC_LOG_BATCH 256
+static struct
+{
+	uint8_t adc;
+	uint32_t period; /* us between values */
+	uint32_t sample_rate;
+	uint32_t decimation;
+	uint16_t average;
+	uint32_t count; /* Samples of current value */
+	uint32_t sum;
+	int len; /* Values in batch */
+	uint64_t time; /* Time of first value in batch */
+	uint16_t values[ADC_LOG_BATCH];
+} adc_log;
+
+/*
+ * Streaming, every DMA buffer is sent as records of ADC_STREAM_RECORD
+ * samples with a sequence number. Lost records still use sequence numbers.
+ */
+#define ADC_STREAM_RECORD 512
+static struct
+{
+	uint8_t adc;
+	uint32_t sample_rate; /* Of I2S, before filter */
+	struct adc_filter filter;
+	uint32_t seq;
+	uint32_t lost; /* Records lost since last sent record */
+	uint64_t last_block; /* Time of last DMA buffer, 0 = none */
+} adc_stream;
+
+/* Measurement over a number of samples, the result is the response */
+static struct
+{
+	struct adc_measure stats;
+	uint32_t rate;
+	uint32_t samples;
+	int32_t tag;
+} adc_measure;
+
+/* Average power spectrum of frames, the result is the response */
+#define ADC_SPECTRUM_LINE 16 /* Bins per line */
+static struct
+{
+	uint32_t rate;
+	int log2n;
+	uint16_t frames; /* To average */
+	uint16_t frame; /* Frames done */
+	int fill; /* Values in current frame */
+	uint8_t peaks; /* Largest peaks to respond with, 0 = all bins */
+	float gain; /* Coherent gain of window */
+	int32_t *data; /* Frame as complex values */
+	int16_t *window;
+	float *power;
+	int32_t tag;
+} adc_spectrum;
+
+/*******************************************************************************
+ * Read calibration points of adc from NVS, a missing point keeps its value
+ *
+ * Return value: 1 if any point is missing, otherwise 0
+ ******************************************************************************/
+static int adc_read_calibration(nvs_handle_t nvs_handle, int adc, int verbose)
+{
+	static const char *names[] =
+	{
+		"adc%d_1x_0_2v", "adc%d_1x_2v", "adc%d_10x_2v", "adc%d_10x_20v"
+	};
+	uint16_t *points[] =
+	{
+		&adc_config[adc].v1x_0_2v, &adc_config[adc].v1x_2v,
+		&adc_config[adc].v10x_2v, &adc_config[adc].v10x_20v
+	};
+	int error_flag = 0;
+
+	for(int i = 0; i < 4; i++)
+	{
+		char parameter_name[25] = {0};
+		uint32_t value;
+
+		snprintf(parameter_name, 24, names[i], adc);
+		if(nvs_get_u32(nvs_handle, parameter_name, &value))
+		{
+			if(verbose)
+				printf("ERR %s not configured\n", parameter_name);
+			error_flag = 1;
+		}
+		else
+			*points[i] = value;
+	}
+
+	return error_flag;
+}
+
+/*
+ * Build the table of adc for the gain in use. The eFuse characterization
+ * corrects the ADC nonlinearity to millivolts at the pin, the two calibration
+ * points then map pin voltage to input voltage through the linear front end.
+ */
+static void adc_lut_build(enum adc adc)
+{
+	int16_t *lut = adc_lut_spare;
+	int amp = adc_config[adc].flags & ADC_FLAG_AMP10X;
+	uint16_t raw_low = amp ? adc_config[adc].v10x_2v : adc_config[adc].v1x_0_2v;
+	uint16_t raw_high = amp ? adc_config[adc].v10x_20v : adc_config[adc].v1x_2v;
+	int32_t uv_low = amp ? 2000000 : 200000;
+	int32_t uv_high = amp ? 20000000 : 2000000;
+	int32_t pin_low = esp_adc_cal_raw_to_voltage(raw_low & 0xfff, &adc_characteristics);
+	int32_t pin_high = esp_adc_cal_raw_to_voltage(raw_high & 0xfff, &adc_characteristics);
+
+	for(int raw = 0; raw < ADC_LUT_SIZE; raw++)
+	{
+		int32_t pin = esp_adc_cal_raw_to_voltage(raw, &adc_characteristics);
+		int32_t uv;
+
+		/* Pin voltage if not calibrated */
+		if(pin_high == pin_low)
+			uv = pin * 1000;
+		else
+			uv = uv_low +
+				(int64_t)(pin - pin_low) * (uv_high - uv_low) / (pin_high - pin_low);
+
+		/* Rounded to mV, the front end gives at most 30 V */
+		int32_t mv = (uv + (uv < 0 ? -500 : 500)) / 1000;
+
+		lut[raw] = mv < INT16_MIN ? INT16_MIN : mv > INT16_MAX ? INT16_MAX : mv;
+	}
+
+	/* Table is complete before it is published */
+	adc_lut_spare = (int16_t*)__atomic_exchange_n(
+		&adc_lut[adc], (const int16_t*)lut, __ATOMIC_ACQ_REL);
+}
+
+/* Reload calibration points from NVS and rebuild tables */
+void adc_calibration_changed()
+{
+	nvs_handle_t nvs_handle;
+
+	if(nvs_open("SWT21 Lab kit", NVS_READONLY, &nvs_handle) != ESP_OK)
+		return;
+
+	for(int i = 0; i < ADC_COUNT; i++)
+	{
+		adc_read_calibration(nvs_handle, i, 0);
+		adc_lut_build(i);
+	}
+
+	nvs_close(nvs_handle);
+}
+
 int adc_init()
 {
 	esp_err_t err;
@@ -94,45 +432,7 @@ int adc_init()
 
 	for(int i = 0; i < ADC_COUNT; i++)
 	{
-		int error_flag = 0;
-		char parameter_name[25] = {0};
-		uint32_t value;
-
-		snprintf(parameter_name, 24, "adc%d_1x_0_2v", i);
-		err = nvs_get_u32(nvs_handle, parameter_name, &value);
-		if(err)
-		{
-			printf("ERR %s not configured\n", parameter_name);
-			error_flag = 1;
-		}
-		adc_config[i].v1x_0_2v = value;
-
-		snprintf(parameter_name, 24, "adc%d_1x_2v", i);
-		err = nvs_get_u32(nvs_handle, parameter_name, &value);
-		if(err)
-		{
-			printf("ERR %s not configured\n", parameter_name);
-			error_flag = 1;
-		}
-		adc_config[i].v1x_2v = value;
-
-		snprintf(parameter_name, 24, "adc%d_10x_2v", i);
-		err = nvs_get_u32(nvs_handle, parameter_name, &value);
-		if(err)
-		{
-			printf("ERR %s not configured\n", parameter_name);
-			error_flag = 1;
-		}
-		adc_config[i].v10x_2v = value;
-
-		snprintf(parameter_name, 24, "adc%d_10x_20v", i);
-		err = nvs_get_u32(nvs_handle, parameter_name, &value);
-		if(err)
-		{
-			printf("ERR %s not configured\n", parameter_name);
-			error_flag = 1;
-		}
-		adc_config[i].v10x_20v = value;
+		int error_flag = adc_read_calibration(nvs_handle, i, 1);
 
 		/* Set channel attenuation */
 		adc1_config_channel_atten(adc_channel[i], ADC_ATTEN_DB_11);
@@ -144,6 +444,18 @@ int adc_init()
 
 	nvs_close(nvs_handle);
 
+	esp_adc_cal_characterize(
+		ADC_UNIT_1, ADC_ATTEN_DB_11, ADC_WIDTH_BIT_12, ADC_DEFAULT_VREF,
+		&adc_characteristics);
+
+	for(int i = 0; i < ADC_COUNT; i++)
+	{
+		adc_lut_spare = adc_lut_tables[i];
+		adc_lut_build(i);
+	}
+
+	adc_lut_spare = adc_lut_tables[ADC_COUNT];
+
 	/*
 	 * Install I2S driver for trigging. Single trig only.
 	 * Read from separate thread.
@@ -176,430 +488,1978 @@ uint16_t adc_single(enum adc adc)
 	return adc1_get_raw(adc_channel[adc]);
 }
 
+/*
+ * Convert enough values for one output of the filter of adc, a CIC filter
+ * needs order outputs to settle
+ *
+ * Return value: raw value with ADC_FILTER_FRACTION fraction bits
+ */
+static uint16_t adc_single_filtered(enum adc adc)
+{
+	static struct adc_filter filter;
+	const struct adc_filter_config *config = &adc_filter_config[adc];
+	int count = config->type == ADC_FILTER_CIC ? config->order * config->ratio :
+	            config->type == ADC_FILTER_NONE ? 1 : config->ratio;
+	uint16_t value = 0;
+
+	adc_filter_reset(&filter, config);
+
+	for(int i = 0; i < count; i++)
+	{
+		uint16_t raw = adc_single(adc);
+
+		adc_filter_run(&filter, &value, &raw, 1);
+	}
+
+	return value;
+}
+
 static void adc_trig_off()
 {
 	struct cmd_event event =
 	{
-		.event = EVENT_CMD_TRIG_OFF
+		.event = EVENT_CMD_TRIG_OFF,
+		.tag = hci_get_tag()
 	};
 
 	xQueueSendToBack(cmd_queue, &event, 0);
 }
 
-static void adc_trig(uint8_t value, uint32_t sample_rate, uint16_t m, uint16_t n)
+static void adc_trig(uint16_t value, uint32_t sample_rate, uint32_t m, uint16_t n)
 {
 	struct cmd_event event =
 	{
 		.event = EVENT_CMD_TRIG,
-		.trig.value = value,
+		.tag = hci_get_tag(),
+		.trig.trigger = adc_trig_mode,
 		.trig.sample_rate = sample_rate,
 		.trig.m = m,
-		.trig.n = n
+		.trig.n = n,
+		.trig.segments = adc_segment_config.count,
+		.trig.holdoff = adc_segment_config.holdoff,
+		.trig.mode = adc_segment_config.mode,
+		.trig.envelope = adc_envelope_config,
+		.trig.scan = adc_scan_config.on,
+		.trig.scan_adc = adc_scan_config.adc
 	};
 
+	event.trig.trigger.level = value;
+
 	xQueueSendToBack(cmd_queue, &event, 0);
 }
 
+/* Interpolated between table entries for values with fraction */
+static float adc_volts(enum adc adc, float raw_value)
+{
+	const int16_t *lut = __atomic_load_n(&adc_lut[adc], __ATOMIC_ACQUIRE);
+
+	if(raw_value <= 0)
+		return lut[0] * 1e-3f;
+
+	if(raw_value >= ADC_LUT_SIZE - 1)
+		return lut[ADC_LUT_SIZE - 1] * 1e-3f;
+
+	int i = raw_value;
+	float fraction = raw_value - i;
+
+	return (lut[i] + fraction * (lut[i + 1] - lut[i])) * 1e-3f;
+}
+
 void adc_print_value(enum adc adc, uint16_t raw_value)
 {
 	if(adc_config[adc].flags & ADC_FLAG_RAW)
-	{
 		printf("ADC%d %d\n", adc, raw_value);
-	}
 	else
 	{
-		int amp = adc_config[adc].flags & ADC_FLAG_AMP10X;
-		float value;
-
-		if(amp)
-			value = 2.0 +
-			        18.0/(adc_config[adc].v10x_20v - adc_config[adc].v10x_2v) *
-			        (raw_value - adc_config[adc].v10x_2v);
-		else
-			value = 0.2 +
-			        1.8/(adc_config[adc].v1x_2v - adc_config[adc].v1x_0_2v) *
-			        (raw_value - adc_config[adc].v1x_0_2v);
+		const int16_t *lut = __atomic_load_n(&adc_lut[adc], __ATOMIC_ACQUIRE);
 
-		printf("ADC%d %0.3f\n", adc, value);
+		printf("ADC%d %0.3f\n", adc, lut[raw_value & 0xfff] / 1000.0);
 	}
 }
 
-static void adc_send_trig_data(int start, uint8_t *data, int len)
+/* value has ADC_FILTER_FRACTION fraction bits */
+static void adc_print_filtered(enum adc adc, uint16_t value)
 {
-	uint8_t buf[2048+30];
-	int n = 0;
+	float raw_value = (float)value / (1 << ADC_FILTER_FRACTION);
+
+	if(adc_config[adc].flags & ADC_FLAG_RAW)
+		printf("ADC%d %0.2f\n", adc, raw_value);
+	else
+		printf("ADC%d %0.4f\n", adc, adc_volts(adc, raw_value));
+}
 
-	n += sprintf((char*)buf, "ADC trig %d+%d\n", start, len);
+/*
+ * Pack pairs of 12-bit samples in three bytes, s0 | s1 << 12 little-endian.
+ * An odd last sample is padded with a zero sample. Every stride sample of
+ * samples is packed.
+ */
+static int adc_pack12(uint8_t *out, const uint16_t *samples, int count, int stride)
+{
+	int n = 0;
 
-	for(int i = 0; i < len; i++)
-		n += sprintf((char*)buf + n, "%02x", data[i]);
+	for(int i = 0; i < count; i += 2)
+	{
+		uint16_t s0 = samples[i * stride];
+		uint16_t s1 = i + 1 < count ? samples[(i + 1) * stride] : 0;
 
-	n += sprintf((char*)buf + n, "\n");
+		out[n++] = s0 & 0xff;
+		out[n++] = (s0 >> 8) | ((s1 & 0xf) << 4);
+		out[n++] = s1 >> 4;
+	}
 
-	hci_print_bytes(buf, n);
+	return n;
 }
 
-void adc_command(int adc)
+/*
+ * Trig data is sent as deferred output, rendered by the HCI TX thread from
+ * the values where they were captured. refs counts chunks not yet written.
+ */
+struct adc_trig_chunk
 {
-	char *cmd = strtok(NULL, " ");
+	uint64_t time; /* Time of first value */
+	const uint16_t *values; /* Every stride value is sent */
+	uint32_t *refs;
+	uint32_t start;
+	uint16_t len;
+	int8_t adc; /* ADC when scanning, otherwise -1 */
+	uint8_t stride;
+	uint16_t captures; /* Segments averaged, values have fraction bits */
+};
 
-	/* Make sure we have a command */
-	if(!cmd)
-		goto einval;
+static int adc_render_trig_record(uint8_t *out, uint8_t sequence, const void *context)
+{
+	const struct adc_trig_chunk *chunk = context;
 
 	/*
-	 * Compare commande against known commands and handle them, otherwise tell
-	 * the user it was invalid.
+	 * <time (u64 le)> [<adc (u8)>] <start (u32 le)> <count (u16 le)>
+	 * <packed values>..., adc only in scan records
 	 */
-	if(strcmp(cmd, "help") == 0)
-	{
-		printf("OK\n");
-		printf(
-			"Available commands:\n"
-			"\n"
-			"adc%d off - turn off periodic adc\n"
-			"adc%d single - convert single value\n"
-#if 0
-	/* This is TODO */
-			"adc%d periodic <period (ms)> [offset (ms)] - convert periodically\n"
-#endif
-			"adc0 trig <trig value> <sample rate> <m> <n> - wait for trigger and\n"
-			"                                              convert m values before and\n"
-			"                                              n values after\n"
-			"adc0 trig off - disable trig\n"
-			"adc%d config raw <on/off> - enable or disable raw values\n"
-			"adc%d config 10x <on/off> - enable 10x, otherwise 1x\n"
-			"\n", adc, adc, adc, adc, adc, adc);
-	}
-	else if(strcmp(cmd, "off") == 0)
-	{
-		adc_off();
-	}
-	else if(strcmp(cmd, "single") == 0)
-	{
-		adc_print_value(adc, adc_single(adc));
-	}
-#if 0
-	/* This is TODO */
-	else if(strcmp(cmd, "periodic") == 0)
-	{
-		int period;
-		int offset;
-		char *arg;
+	uint8_t buf[8 + 1 + 4 + 2 + 3 * ADC_TRIG_RECORD / 2];
+	int n = 0;
 
-		/* Read period argument */
-		arg = strtok(NULL, " ");
-		if(!arg)
-			goto einval;
+	for(int i = 0; i < 8; i++)
+		buf[n++] = (chunk->time >> (8 * i)) & 0xff;
 
-		period = atoi(arg);
+	if(chunk->adc >= 0)
+		buf[n++] = chunk->adc;
 
-		if(period >= 1 << 16)
-			goto einval;
+	for(int i = 0; i < 4; i++)
+		buf[n++] = (chunk->start >> (8 * i)) & 0xff;
 
-		/* Read offset argument */
-		arg = strtok(NULL, " ");
+	buf[n++] = chunk->len & 0xff;
+	buf[n++] = chunk->len >> 8;
 
-		if(arg)
-			offset = atoi(arg);
-		else
-			offset = 0;
+	n += adc_pack12(&buf[n], chunk->values, chunk->len, chunk->stride);
 
-		/* Send command */
-		adc_periodic(period, offset);
-	}
-#endif
-	else if(strcmp(cmd, "test") == 0)
-	{
-		adc_off();
-		adc_trig(128, 8000, 128, 128);
-	}
-	else if(strcmp(cmd, "trig") == 0)
-	{
-		const char *arg;
-		int value;
-		int sample_rate;
-		int m, n;
+	return hci_frame_record(
+		out, chunk->adc >= 0 ? HCI_RECORD_ADC_SCAN : HCI_RECORD_ADC_TRIG,
+		sequence, buf, n);
+}
 
-		/* Only ADC0 supported */
-		if(adc != 0)
-			goto einval;
+static int adc_render_trig_text(uint8_t *out, uint8_t sequence, const void *context)
+{
+	const struct adc_trig_chunk *chunk = context;
+	char *p = (char*)out;
 
-		/* Read value argument */
-		arg = strtok(NULL, " ");
-		if(!arg)
-			goto einval;
+	p = fmt_timestamp(p, chunk->time);
+	p = fmt_str(p, "ADC");
 
-		if(strcmp(arg, "off") == 0)
-		{
-			adc_trig_off();
-			printf("OK\n");
-			return;
-		}
+	if(chunk->adc >= 0)
+		p = fmt_int(p, chunk->adc);
 
-		value = atoi(arg);
+	p = fmt_str(p, " trig ");
+	p = fmt_int(p, chunk->start);
+	*p++ = '+';
+	p = fmt_int(p, chunk->len);
+	*p++ = '\n';
+	p = fmt_hex12_stride(p, chunk->values, chunk->len, chunk->stride);
+	*p++ = '\n';
 
-		if(value < 0 || value > 255)
-			goto einval;
+	return p - (char*)out;
+}
 
-		/* Read sample_rate argument */
-		arg = strtok(NULL, " ");
-		if(!arg)
-			goto einval;
+static int adc_render_average_record(uint8_t *out, uint8_t sequence,
+                                     const void *context)
+{
+	const struct adc_trig_chunk *chunk = context;
 
-		sample_rate = atoi(arg);
+	/*
+	 * <time (u64 le)> <adc (u8)> <start (u32 le)> <count (u16 le)>
+	 * <captures (u16 le)> <value (u16 le)>...
+	 */
+	uint8_t buf[8 + 1 + 4 + 2 + 2 + 2 * ADC_TRIG_RECORD];
+	int n = 0;
 
-		/* Empirical max: 1333328, min probably 2496 */
-		if(sample_rate < 2496 || sample_rate > 1333328)
-			goto einval;
+	for(int i = 0; i < 8; i++)
+		buf[n++] = (chunk->time >> (8 * i)) & 0xff;
 
-		/* Read m argument */
-		arg = strtok(NULL, " ");
+	buf[n++] = chunk->adc < 0 ? 0 : chunk->adc;
 
-		if(!arg)
-			goto einval;
+	for(int i = 0; i < 4; i++)
+		buf[n++] = (chunk->start >> (8 * i)) & 0xff;
 
-		m = atoi(arg);
+	buf[n++] = chunk->len & 0xff;
+	buf[n++] = chunk->len >> 8;
+	buf[n++] = chunk->captures & 0xff;
+	buf[n++] = chunk->captures >> 8;
 
-		if(m < 0 || m > 1024)
-			goto einval;
+	for(int i = 0; i < chunk->len; i++)
+	{
+		buf[n++] = chunk->values[i] & 0xff;
+		buf[n++] = chunk->values[i] >> 8;
+	}
 
-		/* Read n argument */
-		arg = strtok(NULL, " ");
+	return hci_frame_record(out, HCI_RECORD_ADC_AVERAGE, sequence, buf, n);
+}
 
-		if(!arg)
-			goto einval;
+static int adc_render_average_text(uint8_t *out, uint8_t sequence,
+                                   const void *context)
+{
+	const struct adc_trig_chunk *chunk = context;
+	char *p = (char*)out;
+
+	p = fmt_timestamp(p, chunk->time);
+	p = fmt_str(p, "ADC");
+
+	if(chunk->adc >= 0)
+		p = fmt_int(p, chunk->adc);
+
+	p = fmt_str(p, " average ");
+	p = fmt_int(p, chunk->start);
+	*p++ = '+';
+	p = fmt_int(p, chunk->len);
+	*p++ = ' ';
+	p = fmt_int(p, chunk->captures);
+	*p++ = '\n';
+	p = fmt_hex16(p, chunk->values, chunk->len);
+	*p++ = '\n';
+
+	return p - (char*)out;
+}
 
-		n = atoi(arg);
+static void adc_release_trig(const void *context)
+{
+	const struct adc_trig_chunk *chunk = context;
 
-		if(n < 0 || n > 64*1024-1)
-			goto einval;
+	__atomic_fetch_sub(chunk->refs, 1, __ATOMIC_RELEASE);
+}
 
-		/* Send command */
-		adc_off();
-		adc_trig(value, sample_rate, m, n);
-	}	else if(strcmp(cmd, "config") == 0)
-	{
-		/* Read config argument */
-		const char *param = strtok(NULL, " ");
-		if(!param)
-			goto einval;
+/* Wait until all chunks referencing values are written */
+static void adc_wait_released(uint32_t *refs)
+{
+	while(__atomic_load_n(refs, __ATOMIC_ACQUIRE))
+		vTaskDelay(1);
+}
 
-		if(strcmp(param, "raw") == 0)
-		{
-			/* on/off */
-			char *arg;
+/*******************************************************************************
+ * Take TX tokens for a record of size bytes. Streamed records are dropped
+ * when throttled. Records of a batch or average are kept until sent, so they
+ * wait for tokens and ring space instead, which also paces them. trig off
+ * aborts the wait and the rest of the capture is not sent.
+ *
+ * Return value: 0 if the record may be sent, -1 if not
+ ******************************************************************************/
+static int adc_tx_take(int size)
+{
+	struct cmd_event cmd_event;
 
-			/* Read id argument */
-			arg = strtok(NULL, " ");
-			if(!arg)
-				goto einval;
+	if(adc_capture.mode == ADC_CAPTURE_STREAM)
+		return hci_tx_slot_take(adc_tx_slot, size);
 
-			if(strcmp(arg, "on") == 0)
-			{
-				adc_config[adc].flags |= ADC_FLAG_RAW;
-				printf("OK\n");
-				return;
-			}
-			else if(strcmp(arg, "off") == 0)
-			{
-				adc_config[adc].flags &= ~ADC_FLAG_RAW;
-				printf("OK\n");
-				return;
-			}
-			else
-				goto einval;
-		}
+	while(!adc_capture.aborted && hci_tx_slot_poll(adc_tx_slot, size) < 0)
+	{
+		/* Left in the queue, handled when the capture is done */
+		if(xQueuePeek(cmd_queue, &cmd_event, 0) &&
+		   cmd_event.event == EVENT_CMD_TRIG_OFF)
+			adc_capture.aborted = 1;
+		else
+			vTaskDelay(1);
+	}
 
-		else if(strcmp(param, "10x") == 0)
-		{
-			/* on/off */
-			char *arg;
+	return adc_capture.aborted ? -1 : 0;
+}
 
-			/* Read id argument */
-			arg = strtok(NULL, " ");
-			if(!arg)
-				goto einval;
+/*
+ * time is the time of the first value in data, at most 1024 values of adc
+ * every stride value of data. data must not change until refs is back to zero.
+ */
+static void adc_send_trig_data(int adc, uint64_t time, int start,
+                               const uint16_t *data, int len, int stride,
+                               uint32_t *refs)
+{
+	/* Record size estimate, ASCII: "@<time> ADC0 trig 65535+1024\n" + data + "\n" */
+	int size = hci_binary_mode() ? 24 + 3 * len / 2 : 44 + 3 * len;
 
-			if(strcmp(arg, "on") == 0)
-			{
-				adc_config[adc].flags |= ADC_FLAG_AMP10X;
-				printf("OK\n");
-				return;
-			}
-			else if(strcmp(arg, "off") == 0)
-			{
-				adc_config[adc].flags &= ~ADC_FLAG_AMP10X;
-				printf("OK\n");
-				return;
-			}
-			else
-				goto einval;
-		}
-	}
-	else
-		goto einval;
+	if(adc_tx_take(size) < 0)
+		return;
 
-	return;
+	/* Split to fit in frames */
+	int record = hci_binary_mode() ? ADC_TRIG_RECORD : len;
 
-einval:
-	printf(EINVAL);
-	return;
+	for(int i = 0; i < len; i += record)
+	{
+		struct adc_trig_chunk chunk =
+		{
+			.time = time + (uint64_t)i * 1000000 / adc_trig_rate,
+			.values = &data[i * stride],
+			.refs = refs,
+			.start = start + i,
+			.len = len - i < record ? len - i : record,
+			.adc = adc_trig_channels > 1 ? adc : -1,
+			.stride = stride
+		};
+
+		__atomic_fetch_add(refs, 1, __ATOMIC_RELAXED);
+
+		if(hci_binary_mode())
+			hci_write_deferred(
+				adc_render_trig_record, adc_release_trig, &chunk, sizeof(chunk),
+				HCI_FRAME_SIZE(8 + 1 + 4 + 2 + 3 * ADC_TRIG_RECORD / 2));
+		else
+			hci_write_deferred(
+				adc_render_trig_text, adc_release_trig, &chunk, sizeof(chunk),
+				44 + 3 * chunk.len);
+	}
 }
 
-void adc_trig_thread(void *parameters)
+/*
+ * As adc_send_trig_data() for at most ADC_TRIG_RECORD averages of captures
+ * segments with ADC_FILTER_FRACTION fraction bits
+ */
+static void adc_send_average_data(int adc, uint64_t time, int start,
+                                  const uint16_t *data, int len, int captures,
+                                  uint32_t *refs)
 {
-	esp_err_t err;
-	uint8_t stored_values[2][1024];
-	int current_buf = 0;
-	uint8_t first_buf = 0; /* Keep track if we only received zero or one buf */
-	uint16_t m = 0, n = 0;
-	uint8_t value = 0;
-	int trig_len = 0;
-
-	/*
-	 * <----------------buf 0------------><------------buf 1-------------->
-	 *                          <-----m----->T<-----n----->
-	 *                    <-----m----->T<-----n----->
-	 *    <-----m----->T<-----n----->
-	 *
-	 * If m + n < buffer size then three cases on trig:
-	 * - M extends into previous buffer
-	 * - All fits inside current buffer
-	 * - N extends into next buffer
-	 */
+	/* ASCII: "@<time> ADC0 average 65535+512 1000\n" + data + "\n" */
+	int size = hci_binary_mode() ? 28 + 2 * len : 48 + 4 * len;
 
-	esp_task_wdt_delete(xTaskGetCurrentTaskHandle());
+	if(adc_tx_take(size) < 0)
+		return;
 
-	enum
+	struct adc_trig_chunk chunk =
 	{
-		STATE_TRIG_OFF,
-		STATE_TRIG_SEARCHING,
-		STATE_TRIG_FOUND
-	} state = STATE_TRIG_OFF;
+		.time = time,
+		.values = data,
+		.refs = refs,
+		.start = start,
+		.len = len,
+		.adc = adc_trig_channels > 1 ? adc : -1,
+		.stride = 1,
+		.captures = captures
+	};
 
+	__atomic_fetch_add(refs, 1, __ATOMIC_RELAXED);
 
-	while(1)
+	if(hci_binary_mode())
+		hci_write_deferred(
+			adc_render_average_record, adc_release_trig, &chunk, sizeof(chunk),
+			HCI_FRAME_SIZE(8 + 1 + 4 + 2 + 2 + 2 * ADC_TRIG_RECORD));
+	else
+		hci_write_deferred(
+			adc_render_average_text, adc_release_trig, &chunk, sizeof(chunk),
+			size);
+}
+
+static void adc_send_segment_header(int segment)
+{
+	struct adc_segment *seg = &adc_capture.segments[segment];
+
+	if(hci_binary_mode())
 	{
 		/*
-		 * QueueSet implementation causes abort() if it is ever becoming full
-		 * so we do not use it
+		 * <time (u64 le)> <segment (u16 le)> <segments (u16 le)>
+		 * <trigger (u32 le)> <count (u32 le)>
 		 */
-		i2s_event_t i2s_event;
-		if(xQueueReceive(i2s_queue, &i2s_event, 10))
-		{
-			if(i2s_event.type == I2S_EVENT_RX_DONE)
-			{
-				size_t bytes_read;
-				uint8_t buf[2048];
-				i2s_read(I2S_NUM_0, buf, 2048, &bytes_read, 0);
+		uint8_t buf[8 + 2 + 2 + 4 + 4];
+		int n = 0;
+
+		for(int i = 0; i < 8; i++)
+			buf[n++] = (seg->time >> (8 * i)) & 0xff;
+
+		buf[n++] = segment & 0xff;
+		buf[n++] = segment >> 8;
+		buf[n++] = adc_capture.count & 0xff;
+		buf[n++] = adc_capture.count >> 8;
+
+		for(int i = 0; i < 4; i++)
+			buf[n++] = (adc_capture.trigger >> (8 * i)) & 0xff;
+
+		for(int i = 0; i < 4; i++)
+			buf[n++] = (adc_capture.len >> (8 * i)) & 0xff;
+
+		hci_send_record(HCI_RECORD_ADC_SEGMENT, buf, n);
+		return;
+	}
+
+	char buf[64];
+	char *p = buf;
+
+	p = fmt_timestamp(p, seg->time);
+	p = fmt_str(p, "ADC segment ");
+	p = fmt_int(p, segment);
+	*p++ = '/';
+	p = fmt_int(p, adc_capture.count);
+	*p++ = ' ';
+	p = fmt_int(p, adc_capture.trigger);
+	*p++ = ' ';
+	p = fmt_int(p, adc_capture.len);
+	*p++ = '\n';
+
+	hci_print_bytes((uint8_t*)buf, p - buf);
+}
+
+/* Send pairs of adc in segment */
+static void adc_envelope_send(int adc, int segment)
+{
+	int count = adc_envelope.count[adc];
+	uint32_t start = adc_envelope.start[adc];
+	uint16_t *pairs = adc_envelope.pairs[adc];
+	uint64_t time = adc_capture.segments[segment].time +
+		((int64_t)start - adc_capture.trigger) * 1000000 / adc_trig_rate;
+	int size = hci_binary_mode() ? 28 + 3 * count : 48 + 6 * count;
+
+	if(count == 0)
+		return;
+
+	adc_envelope.start[adc] += count * adc_envelope.bucket;
+	adc_envelope.count[adc] = 0;
+
+	if(adc_tx_take(size) < 0)
+		return;
+
+	if(hci_binary_mode())
+	{
+		/*
+		 * <time (u64 le)> <adc (u8)> <start (u32 le)> <count (u16 le)>
+		 * <bucket (u16 le)> <packed min, max>...
+		 */
+		static uint8_t buf[8 + 1 + 4 + 2 + 2 + 3 * ADC_ENVELOPE_RECORD];
+		int n = 0;
+
+		for(int i = 0; i < 8; i++)
+			buf[n++] = (time >> (8 * i)) & 0xff;
+
+		buf[n++] = adc;
+
+		for(int i = 0; i < 4; i++)
+			buf[n++] = (start >> (8 * i)) & 0xff;
+
+		buf[n++] = count & 0xff;
+		buf[n++] = count >> 8;
+		buf[n++] = adc_envelope.bucket & 0xff;
+		buf[n++] = adc_envelope.bucket >> 8;
+
+		n += adc_pack12(&buf[n], pairs, 2 * count, 1);
+
+		hci_send_record(HCI_RECORD_ADC_ENVELOPE, buf, n);
+	}
+	else
+	{
+		static char buf[48 + 6 * ADC_ENVELOPE_RECORD];
+		char *p = buf;
+
+		p = fmt_timestamp(p, time);
+		p = fmt_str(p, "ADC");
+
+		if(adc_trig_channels > 1)
+			p = fmt_int(p, adc);
+
+		p = fmt_str(p, " envelope ");
+		p = fmt_int(p, start);
+		*p++ = '+';
+		p = fmt_int(p, count);
+		*p++ = ' ';
+		p = fmt_int(p, adc_envelope.bucket);
+		*p++ = '\n';
+		p = fmt_hex12(p, pairs, 2 * count);
+		*p++ = '\n';
+
+		hci_print_bytes((uint8_t*)buf, p - buf);
+	}
+}
+
+/* Start envelopes of a segment at value index start */
+static void adc_envelope_begin(uint32_t start)
+{
+	for(int adc = 0; adc < adc_trig_channels; adc++)
+	{
+		adc_envelope_reset(&adc_envelope.state[adc], adc_envelope.bucket);
+		adc_envelope.start[adc] = start;
+		adc_envelope.count[adc] = 0;
+	}
+}
+
+/* Values of adc in segment, every stride value of data */
+static void adc_envelope_data(int adc, int segment, const uint16_t *data,
+                              int len, int stride)
+{
+	struct adc_envelope *state = &adc_envelope.state[adc];
+
+	while(len > 0)
+	{
+		int count = adc_envelope.count[adc];
+		/* Values that fill at most the rest of the record */
+		int n = (ADC_ENVELOPE_RECORD - count) * adc_envelope.bucket - state->fill;
+
+		if(n > len)
+			n = len;
+
+		adc_envelope.count[adc] += adc_envelope_run(
+			state, &adc_envelope.pairs[adc][2 * count], data, n, stride);
+
+		data += n * stride;
+		len -= n;
+
+		if(adc_envelope.count[adc] == ADC_ENVELOPE_RECORD)
+			adc_envelope_send(adc, segment);
+	}
+}
+
+/* Send the last pairs of a segment */
+static void adc_envelope_end(int segment)
+{
+	for(int adc = 0; adc < adc_trig_channels; adc++)
+	{
+		int count = adc_envelope.count[adc];
+
+		adc_envelope.count[adc] += adc_envelope_finish(
+			&adc_envelope.state[adc], &adc_envelope.pairs[adc][2 * count]);
+
+		adc_envelope_send(adc, segment);
+	}
+}
+
+/*******************************************************************************
+ * Free a capture once its values are sent
+ ******************************************************************************/
+static void adc_capture_free()
+{
+	adc_wait_released(&adc_capture.refs);
+
+	free(adc_capture.segments);
+	free(adc_capture.values);
+	free(adc_capture.sums);
+
+	adc_capture.segments = NULL;
+	adc_capture.values = NULL;
+	adc_capture.sums = NULL;
+}
+
+/*******************************************************************************
+ * Allocate segments for a capture
+ *
+ * Return value: 0 on success, -1 if out of memory
+ ******************************************************************************/
+static int adc_capture_alloc(int count, int mode, int trigger, int len)
+{
+	int values = adc_trig_channels * len;
+
+	adc_capture_free();
+
+	adc_capture.count = count;
+	adc_capture.current = 0;
+	adc_capture.mode = mode;
+	adc_capture.trigger = trigger;
+	adc_capture.len = len;
+	adc_capture.segments = malloc(count * sizeof(struct adc_segment));
+
+	if(mode == ADC_CAPTURE_BATCH)
+		adc_capture.values = malloc(count * values * sizeof(uint16_t));
+	else if(mode == ADC_CAPTURE_AVERAGE)
+	{
+		adc_capture.values = malloc(values * sizeof(uint16_t));
+		adc_capture.sums = calloc(values, sizeof(uint32_t));
+	}
+
+	if(!adc_capture.segments ||
+	   (mode != ADC_CAPTURE_STREAM && !adc_capture.values) ||
+	   (mode == ADC_CAPTURE_AVERAGE && !adc_capture.sums))
+	{
+		adc_capture_free();
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Start next segment, time is the time of the trigger value */
+static void adc_capture_begin(uint64_t time, int start)
+{
+	struct adc_segment *seg = &adc_capture.segments[adc_capture.current];
+
+	seg->time = time;
+	seg->start = start;
+
+	/* A single capture is sent as before, without segment header */
+	if(adc_capture.mode == ADC_CAPTURE_STREAM && adc_capture.count > 1)
+		adc_send_segment_header(adc_capture.current);
+
+	if(adc_capture.mode == ADC_CAPTURE_STREAM && adc_envelope.bucket)
+		adc_envelope_begin(start);
+}
+
+/*
+ * Values of adc in the current segment, every adc_trig_channels value of
+ * data. time is the time of the first value.
+ */
+static void adc_capture_data(int adc, uint64_t time, int start,
+                             const uint16_t *data, int len, uint32_t *refs)
+{
+	int stride = adc_trig_channels;
+
+	if(adc_capture.mode == ADC_CAPTURE_BATCH)
+	{
+		uint16_t *values = &adc_capture.values[
+			(adc_capture.current * stride + adc) * adc_capture.len + start];
+
+		for(int i = 0; i < len; i++)
+			values[i] = data[i * stride];
+	}
+	else if(adc_capture.mode == ADC_CAPTURE_AVERAGE)
+	{
+		uint32_t *sums = &adc_capture.sums[adc * adc_capture.len + start];
+
+		for(int i = 0; i < len; i++)
+			sums[i] += data[i * stride];
+	}
+	else if(adc_envelope.bucket)
+		adc_envelope_data(adc, adc_capture.current, data, len, stride);
+	else
+		adc_send_trig_data(adc, time, start, data, len, stride, refs);
+}
+
+/*******************************************************************************
+ * End current segment
+ *
+ * Return value: 1 if all segments are captured
+ ******************************************************************************/
+static int adc_capture_end()
+{
+	if(adc_capture.mode == ADC_CAPTURE_STREAM && adc_envelope.bucket)
+		adc_envelope_end(adc_capture.current);
+
+	adc_capture.current += 1;
+
+	return adc_capture.current == adc_capture.count;
+}
+
+/*
+ * Send the average of all segments. Values before the latest start of a
+ * segment are missing in some segments and are not sent.
+ */
+static void adc_capture_flush_average()
+{
+	int count = adc_capture.count;
+	uint32_t start = 0;
+
+	for(int segment = 0; segment < count; segment++)
+		if(adc_capture.segments[segment].start > start)
+			start = adc_capture.segments[segment].start;
+
+	/* Rounded, with fraction bits as filtered values */
+	for(int i = 0; i < adc_trig_channels * adc_capture.len; i++)
+		adc_capture.values[i] =
+			(((uint64_t)adc_capture.sums[i] << ADC_FILTER_FRACTION) + count / 2) /
+			count;
+
+	uint64_t time = adc_capture.segments[0].time -
+		(uint64_t)adc_capture.trigger * 1000000 / adc_trig_rate;
+
+	for(int i = start; i < adc_capture.len && !adc_capture.aborted;
+	    i += ADC_TRIG_RECORD)
+	{
+		int len = adc_capture.len - i < ADC_TRIG_RECORD ?
+			adc_capture.len - i : ADC_TRIG_RECORD;
+
+		for(int adc = 0; adc < adc_trig_channels; adc++)
+			adc_send_average_data(
+				adc, time + (uint64_t)i * 1000000 / adc_trig_rate, i,
+				&adc_capture.values[adc * adc_capture.len + i], len, count,
+				&adc_capture.refs);
+	}
+}
+
+/* Send len values of a batch segment from start */
+static void adc_capture_send(int segment, int start, int len)
+{
+	struct adc_segment *seg = &adc_capture.segments[segment];
+	uint16_t *values =
+		&adc_capture.values[segment * adc_trig_channels * adc_capture.len];
+	uint64_t time = seg->time -
+		(uint64_t)adc_capture.trigger * 1000000 / adc_trig_rate;
+
+	for(int i = start; i < start + len && !adc_capture.aborted;
+	    i += adc_trig_block)
+	{
+		int n = start + len - i < adc_trig_block ? start + len - i : adc_trig_block;
+
+		for(int adc = 0; adc < adc_trig_channels; adc++)
+			adc_send_trig_data(
+				adc, time + (uint64_t)i * 1000000 / adc_trig_rate, i,
+				&values[adc * adc_capture.len + i], n, 1, &adc_capture.refs);
+	}
+}
+
+/* Send all segments of a batch, or their envelopes */
+static void adc_capture_flush()
+{
+	adc_capture.aborted = 0;
+
+	if(adc_capture.mode == ADC_CAPTURE_AVERAGE)
+		adc_capture_flush_average();
+
+	if(adc_capture.mode != ADC_CAPTURE_BATCH)
+		return;
+
+	for(int segment = 0; segment < adc_capture.count && !adc_capture.aborted;
+	    segment++)
+	{
+		struct adc_segment *seg = &adc_capture.segments[segment];
+		uint16_t *values =
+			&adc_capture.values[segment * adc_trig_channels * adc_capture.len];
+
+		adc_send_segment_header(segment);
+
+		if(!adc_envelope.bucket)
+		{
+			adc_capture_send(segment, seg->start, adc_capture.len - seg->start);
+			continue;
+		}
+
+		adc_envelope_begin(seg->start);
+
+		for(int adc = 0; adc < adc_trig_channels; adc++)
+			adc_envelope_data(
+				adc, segment, &values[adc * adc_capture.len + seg->start],
+				adc_capture.len - seg->start, 1);
+
+		adc_envelope_end(segment);
+	}
+}
+
+/* All segments of a batch are captured and kept */
+static int adc_capture_complete()
+{
+	return adc_capture.mode == ADC_CAPTURE_BATCH && adc_capture.values &&
+	       adc_capture.current == adc_capture.count;
+}
+
+/* Send values of a complete batch, to zoom in on an envelope */
+static void adc_capture_zoom(int segment, uint32_t start, uint32_t len)
+{
+	if(!adc_capture_complete() || segment >= adc_capture.count ||
+	   start < adc_capture.segments[segment].start || len == 0 ||
+	   start + len > adc_capture.len)
+		goto einval;
+
+	printf("OK\n");
+
+	adc_capture.aborted = 0;
+
+	if(adc_capture.count > 1)
+		adc_send_segment_header(segment);
+
+	adc_capture_send(segment, start, len);
+	return;
+
+einval:
+	printf(EINVAL);
+}
+
+static void adc_off()
+{
+	struct cmd_event event =
+	{
+		.event = EVENT_CMD_PERIODIC_OFF,
+		.tag = hci_get_tag()
+	};
+
+	xQueueSendToBack(cmd_queue, &event, 0);
+}
+
+static void adc_cmd_off(int adc, const union command_value *args, int count)
+{
+	adc_off();
+}
+
+static void adc_cmd_single(int adc, const union command_value *args, int count)
+{
+	if(adc_filter_config[adc].type == ADC_FILTER_NONE)
+		adc_print_value(adc, adc_single(adc));
+	else
+		adc_print_filtered(adc, adc_single_filtered(adc));
+}
+
+static void adc_cmd_periodic(int adc, const union command_value *args, int count)
+{
+	uint32_t rate = args[0].i;
+	uint16_t average = count > 1 ? args[1].i : 1;
+
+	/* Decimate to rates below what I2S can sample at */
+	uint32_t decimation = (ADC_I2S_MIN_RATE + rate - 1) / rate;
+
+	if(decimation < average)
+		decimation = average;
+
+	if((uint64_t)rate * decimation > ADC_I2S_MAX_RATE)
+		goto einval;
+
+	struct cmd_event event =
+	{
+		.event = EVENT_CMD_PERIODIC,
+		.tag = hci_get_tag(),
+		.periodic.adc = adc,
+		.periodic.rate = rate,
+		.periodic.decimation = decimation,
+		.periodic.average = average
+	};
+
+	xQueueSendToBack(cmd_queue, &event, 0);
+	return;
+
+einval:
+	printf(EINVAL);
+}
+
+static void adc_cmd_stream(int adc, const union command_value *args, int count)
+{
+	uint64_t rate = count > 0 ? args[0].i : 0;
+
+	/* The filter decimates values sampled at a higher rate */
+	rate *= adc_filter_decimation(&adc_filter_config[adc]);
+
+	if(rate && (rate < ADC_I2S_MIN_RATE || rate > ADC_I2S_MAX_RATE))
+		goto einval;
+
+	struct cmd_event event =
+	{
+		.event = EVENT_CMD_STREAM,
+		.tag = hci_get_tag(),
+		.stream.adc = adc,
+		.stream.rate = count > 0 ? args[0].i : 0,
+		.stream.filter = adc_filter_config[adc]
+	};
+
+	xQueueSendToBack(cmd_queue, &event, 0);
+	return;
+
+einval:
+	printf(EINVAL);
+}
+
+static void adc_cmd_measure(int adc, const union command_value *args, int count)
+{
+	struct cmd_event event =
+	{
+		.event = EVENT_CMD_MEASURE,
+		.tag = hci_get_tag(),
+		.measure.rate = args[0].i,
+		.measure.samples = count > 1 ? args[1].i : 65536
+	};
+
+	xQueueSendToBack(cmd_queue, &event, 0);
+}
+
+static void adc_cmd_spectrum(int adc, const union command_value *args, int count)
+{
+	struct cmd_event event =
+	{
+		.event = EVENT_CMD_SPECTRUM,
+		.tag = hci_get_tag(),
+		.spectrum.rate = args[0].i,
+		.spectrum.points = args[1].i,
+		.spectrum.window = count > 2 ? args[2].i : ADC_WINDOW_HANN,
+		.spectrum.frames = count > 3 ? args[3].i : 1,
+		.spectrum.peaks = count > 4 ? args[4].i : 0
+	};
+
+	if(adc_fft_log2(args[1].i) < 0)
+		goto einval;
+
+	xQueueSendToBack(cmd_queue, &event, 0);
+	return;
+
+einval:
+	printf(EINVAL);
+}
+
+static void adc_cmd_stream_off(int adc, const union command_value *args, int count)
+{
+	struct cmd_event event =
+	{
+		.event = EVENT_CMD_STREAM_OFF,
+		.tag = hci_get_tag()
+	};
+
+	xQueueSendToBack(cmd_queue, &event, 0);
+}
+
+static void adc_cmd_test(int adc, const union command_value *args, int count)
+{
+	adc_trig(2048, 8000, 128, 128);
+}
+
+static void adc_cmd_trig(int adc, const union command_value *args, int count)
+{
+	/* Both ADCs share the I2S sample rate when scanning */
+	if(adc_scan_config.on && args[1].i > ADC_I2S_MAX_RATE / 2)
+		goto einval;
+
+	/* Send command, the trig thread stops what it is doing and responds */
+	adc_trig(args[0].i, args[1].i, args[2].i, args[3].i);
+	return;
+
+einval:
+	printf(EINVAL);
+}
+
+static void adc_cmd_trig_off(int adc, const union command_value *args, int count)
+{
+	adc_trig_off();
+	printf("OK\n");
+}
+
+static void adc_cmd_trig_edge(int adc, const union command_value *args, int count)
+{
+	static const uint8_t modes[] =
+	{
+		ADC_TRIG_ANY, ADC_TRIG_RISING, ADC_TRIG_FALLING, ADC_TRIG_EITHER
+	};
+
+	adc_trig_mode.mode = modes[args[0].i];
+	adc_trig_mode.hysteresis = count > 1 ? args[1].i : 0;
+
+	printf("OK\n");
+}
+
+static void adc_cmd_trig_window(int adc, const union command_value *args, int count)
+{
+	adc_trig_mode.mode = args[0].i == 0 ? ADC_TRIG_ENTER : ADC_TRIG_LEAVE;
+	adc_trig_mode.high = args[1].i;
+	adc_trig_mode.hysteresis = count > 2 ? args[2].i : 0;
+
+	printf("OK\n");
+}
+
+static void adc_cmd_trig_segments(int adc, const union command_value *args, int count)
+{
+	static const uint8_t modes[] =
+	{
+		ADC_CAPTURE_BATCH, ADC_CAPTURE_STREAM, ADC_CAPTURE_AVERAGE
+	};
+
+	adc_segment_config.count = args[0].i;
+	adc_segment_config.holdoff = count > 1 ? args[1].i : 0;
+	adc_segment_config.mode = count > 2 ? modes[args[2].i] : ADC_CAPTURE_STREAM;
+
+	printf("OK\n");
+}
+
+static void adc_cmd_trig_envelope(int adc, const union command_value *args, int count)
+{
+	adc_envelope_config = args[0].i;
+
+	printf("OK\n");
+}
+
+static void adc_cmd_trig_zoom(int adc, const union command_value *args, int count)
+{
+	struct cmd_event event =
+	{
+		.event = EVENT_CMD_ZOOM,
+		.tag = hci_get_tag(),
+		.zoom.segment = args[0].i,
+		.zoom.start = args[1].i,
+		.zoom.len = args[2].i
+	};
+
+	xQueueSendToBack(cmd_queue, &event, 0);
+}
+
+static void adc_cmd_trig_scan(int adc, const union command_value *args, int count)
+{
+	adc_scan_config.on = args[0].i;
+	adc_scan_config.adc = count > 1 ? args[1].i : 0;
+
+	printf("OK\n");
+}
+
+static void adc_cmd_trig_pulse(int adc, const union command_value *args, int count)
+{
+	adc_trig_mode.mode = args[0].i == 0 ? ADC_TRIG_WIDER : ADC_TRIG_NARROWER;
+	adc_trig_mode.width = args[1].i;
+	adc_trig_mode.hysteresis = count > 2 ? args[2].i : 0;
+
+	printf("OK\n");
+}
+
+static void adc_cmd_config_raw(int adc, const union command_value *args, int count)
+{
+	if(args[0].i)
+		adc_config[adc].flags |= ADC_FLAG_RAW;
+	else
+		adc_config[adc].flags &= ~ADC_FLAG_RAW;
+
+	printf("OK\n");
+}
+
+static void adc_cmd_config_10x(int adc, const union command_value *args, int count)
+{
+	if(args[0].i)
+		adc_config[adc].flags |= ADC_FLAG_AMP10X;
+	else
+		adc_config[adc].flags &= ~ADC_FLAG_AMP10X;
+
+	adc_lut_build(adc);
+
+	printf("OK\n");
+}
+
+static void adc_cmd_config_filter(int adc, const union command_value *args, int count)
+{
+	struct adc_filter_config config =
+	{
+		.type = args[0].i,
+		.ratio = count > 1 ? args[1].i : 16,
+		.order = count > 2 ? args[2].i : 3
+	};
+
+	if(!adc_filter_valid(&config))
+		goto einval;
+
+	adc_filter_config[adc] = config;
+
+	printf("OK\n");
+	return;
+
+einval:
+	printf(EINVAL);
+}
+
+/* Must be sorted by name */
+static const struct command adc_commands[] =
+{
+	{ "config 10x", "enable 10x, otherwise 1x", adc_cmd_config_10x,
+		{ { "on/off", ARG_ONOFF } } },
+	{ "config filter", "filter single values and streaming, average and cic "
+	                   "decimate by ratio, boxcar is a moving average of ratio "
+	                   "values", adc_cmd_config_filter,
+		{ { "none/average/boxcar/cic", ARG_CHOICE, 0, 0, 0,
+		    "none|average|boxcar|cic" },
+		  { "ratio", ARG_INT, ARG_OPTIONAL, 1, 65535 },
+		  { "order", ARG_INT, ARG_OPTIONAL, 1, ADC_CIC_MAX_ORDER } } },
+	{ "config raw", "enable or disable raw values", adc_cmd_config_raw,
+		{ { "on/off", ARG_ONOFF } } },
+	{ "measure", "sample at sample rate and return statistics instead of values",
+		adc_cmd_measure,
+		{ { "sample rate", ARG_INT, 0, 2496, 1333328 },
+		  { "samples", ARG_INT, ARG_OPTIONAL, 1024, 100000000 } },
+		1 << ADC0 },
+	{ "off", "turn off periodic adc", adc_cmd_off },
+	{ "periodic", "log raw values at rate Hz, each an average of samples",
+		adc_cmd_periodic,
+		{ { "rate", ARG_INT, 0, 1, 20000 },
+		  { "average", ARG_INT, ARG_OPTIONAL, 1, 65535 } } },
+	{ "single", "convert single value", adc_cmd_single },
+	{ "spectrum", "sample frames of points values at sample rate and return "
+	              "their average spectrum, or its largest peaks",
+		adc_cmd_spectrum,
+		{ { "sample rate", ARG_INT, 0, 2496, 1333328 },
+		  { "points", ARG_INT, 0, ADC_FFT_MIN, ADC_FFT_MAX },
+		  { "rect/hann/blackman", ARG_CHOICE, ARG_OPTIONAL, 0, 0,
+		    "rect|hann|blackman" },
+		  { "averages", ARG_INT, ARG_OPTIONAL, 1, 1000 },
+		  { "peaks", ARG_INT, ARG_OPTIONAL, 0, 32 } },
+		1 << ADC0 },
+	{ "stream", "stream samples continuously, by default at the highest rate "
+	            "the link sustains", adc_cmd_stream,
+		{ { "sample rate", ARG_INT, ARG_OPTIONAL, 1, 1333328 } } },
+	{ "stream off", "stop streaming", adc_cmd_stream_off },
+	{ "test", NULL, adc_cmd_test, {}, 1 << ADC0 },
+	/* Empirical max sample rate: 1333328, min probably 2496 */
+	{ "trig", "wait for trigger and convert m values before and n values after",
+		adc_cmd_trig,
+		{ { "trig value", ARG_INT, 0, 0, 4095 },
+		  { "sample rate", ARG_INT, 0, 2496, 1333328 },
+		  { "m", ARG_INT, 0, 0, 1000000 },
+		  { "n", ARG_INT, 0, 0, 64*1024-1 } },
+		1 << ADC0 },
+	{ "trig edge", "trig on any crossing of trig value, or on rising, falling "
+	               "or either edge after passing the hysteresis band",
+		adc_cmd_trig_edge,
+		{ { "any/rising/falling/either", ARG_CHOICE, 0, 0, 0,
+		    "any|rising|falling|either" },
+		  { "hysteresis", ARG_INT, ARG_OPTIONAL, 0, 4095 } },
+		1 << ADC0 },
+	{ "trig envelope", "send the min and max of every bucket values of "
+	                   "captures instead of the values, 0 sends values",
+		adc_cmd_trig_envelope,
+		{ { "bucket", ARG_INT, 0, 0, 65535 } },
+		1 << ADC0 },
+	{ "trig off", "disable trig", adc_cmd_trig_off, {}, 1 << ADC0 },
+	{ "trig pulse", "trig at the end of a high pulse over trig value wider or "
+	                "narrower than samples",
+		adc_cmd_trig_pulse,
+		{ { "wider/narrower", ARG_CHOICE, 0, 0, 0, "wider|narrower" },
+		  { "samples", ARG_INT, 0, 1, 1000000 },
+		  { "hysteresis", ARG_INT, ARG_OPTIONAL, 0, 4095 } },
+		1 << ADC0 },
+	{ "trig scan", "capture adc0 and adc1 interleaved at sample rate each, "
+	               "trig on adc", adc_cmd_trig_scan,
+		{ { "on/off", ARG_ONOFF },
+		  { "adc", ARG_INT, ARG_OPTIONAL, 0, ADC_COUNT - 1 } },
+		1 << ADC0 },
+	{ "trig segments", "capture count segments per trig, skipping holdoff "
+	                   "values between them, sent as one batch when done, "
+	                   "each while captured or averaged",
+		adc_cmd_trig_segments,
+		{ { "count", ARG_INT, 0, 1, 1000 },
+		  { "holdoff", ARG_INT, ARG_OPTIONAL, 0, 1000000000 },
+		  { "batch/stream/average", ARG_CHOICE, ARG_OPTIONAL, 0, 0,
+		    "batch|stream|average" } },
+		1 << ADC0 },
+	{ "trig window", "trig when entering or leaving trig value to high",
+		adc_cmd_trig_window,
+		{ { "enter/leave", ARG_CHOICE, 0, 0, 0, "enter|leave" },
+		  { "high", ARG_INT, 0, 0, 4095 },
+		  { "hysteresis", ARG_INT, ARG_OPTIONAL, 0, 4095 } },
+		1 << ADC0 },
+	{ "trig zoom", "send len values from start of a segment of the last "
+	               "batch", adc_cmd_trig_zoom,
+		{ { "segment", ARG_INT, 0, 0, 999 },
+		  { "start", ARG_INT, 0, 0, 2000000 },
+		  { "len", ARG_INT, 0, 1, 2000000 } },
+		1 << ADC0 },
+};
+
+const struct command_table adc_command_table =
+{
+	NULL, adc_commands, COMMAND_COUNT(adc_commands)
+};
+
+static void adc_ring_free()
+{
+	for(int i = 0; i < adc_ring.count + ADC_RING_SPARES && adc_ring.blocks; i++)
+	{
+		if(adc_ring.blocks[i])
+			adc_wait_released(&adc_ring.blocks[i]->refs);
+
+		free(adc_ring.blocks[i]);
+	}
+
+	free(adc_ring.blocks);
+
+	adc_ring.blocks = NULL;
+	adc_ring.count = 0;
+}
+
+/*******************************************************************************
+ * Allocate a ring with room for history values before the latest buffer
+ *
+ * Return value: 0 on success, -1 if out of memory
+ ******************************************************************************/
+static int adc_ring_alloc(int history)
+{
+	int count = (history + adc_trig_block - 1) / adc_trig_block + 1;
+
+	adc_ring_free();
+
+	adc_ring.blocks = calloc(count + ADC_RING_SPARES, sizeof(struct adc_block*));
+	if(!adc_ring.blocks)
+		return -1;
+
+	adc_ring.count = count;
+	adc_ring.head = 0;
+	adc_ring.filled = 0;
+
+	/* One allocation per buffer to cope with fragmented heap */
+	for(int i = 0; i < count + ADC_RING_SPARES; i++)
+	{
+		adc_ring.blocks[i] = malloc(sizeof(struct adc_block));
+		if(!adc_ring.blocks[i])
+		{
+			adc_ring_free();
+			return -1;
+		}
+
+		adc_ring.blocks[i]->refs = 0;
+	}
+
+	return 0;
+}
+
+/* Advance head to the buffer to read next, waits if all spares are in use */
+static struct adc_block *adc_ring_next()
+{
+	adc_ring.head = (adc_ring.head + 1) % adc_ring.count;
+
+	struct adc_block **head = &adc_ring.blocks[adc_ring.head];
+
+	while(__atomic_load_n(&(*head)->refs, __ATOMIC_ACQUIRE))
+	{
+		for(int i = adc_ring.count; i < adc_ring.count + ADC_RING_SPARES; i++)
+		{
+			struct adc_block *spare = adc_ring.blocks[i];
+
+			if(!__atomic_load_n(&spare->refs, __ATOMIC_ACQUIRE))
+			{
+				adc_ring.blocks[i] = *head;
+				*head = spare;
+				return spare;
+			}
+		}
+
+		vTaskDelay(1);
+	}
+
+	return *head;
+}
+
+/* Buffer back buffers before the latest */
+static struct adc_block *adc_ring_block(int back)
+{
+	return adc_ring.blocks[(adc_ring.head - back + adc_ring.count) % adc_ring.count];
+}
+
+/*
+ * Time of value index in a DMA buffer of adc_trig_block values per ADC,
+ * block_end is when the buffer was received
+ */
+static uint64_t adc_sample_time(uint64_t block_end, int index, uint32_t sample_rate)
+{
+	return block_end - (uint64_t)(adc_trig_block - index) * 1000000 / sample_rate;
+}
+
+/* Capture len values of every ADC from index of a DMA buffer */
+static void adc_capture_block(struct adc_block *block, int index, int start, int len)
+{
+	uint64_t time = adc_sample_time(block->time, index, adc_trig_rate);
+
+	for(int adc = 0; adc < adc_trig_channels; adc++)
+		adc_capture_data(
+			adc, time, start, &block->values[index * adc_trig_channels + adc],
+			len, &block->refs);
+}
+
+/*
+ * Capture the len values before the latest buffer, from start. Values before
+ * start were not received since armed.
+ */
+static void adc_ring_history(int start, int len)
+{
+	while(start < len)
+	{
+		int back = len - start; /* Values before the latest buffer */
+		int blocks = (back + adc_trig_block - 1) / adc_trig_block;
+		int index = blocks * adc_trig_block - back;
+		int count = adc_trig_block - index < back ? adc_trig_block - index : back;
+
+		adc_capture_block(adc_ring_block(blocks), index, start, count);
+
+		start += count;
+	}
+}
+
+static void adc_spectrum_free()
+{
+	free(adc_spectrum.data);
+	free(adc_spectrum.window);
+	free(adc_spectrum.power);
+
+	adc_spectrum.data = NULL;
+	adc_spectrum.window = NULL;
+	adc_spectrum.power = NULL;
+}
+
+/*******************************************************************************
+ * Allocate frame, window and power bins for points values
+ *
+ * Return value: 0 on success, -1 if out of memory
+ ******************************************************************************/
+static int adc_spectrum_alloc(int points)
+{
+	adc_spectrum_free();
+
+	adc_spectrum.data = malloc(2 * points * sizeof(int32_t));
+	adc_spectrum.window = malloc(points * sizeof(int16_t));
+	adc_spectrum.power = calloc(points / 2 + 1, sizeof(float));
+
+	if(!adc_spectrum.data || !adc_spectrum.window || !adc_spectrum.power)
+	{
+		adc_spectrum_free();
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Alternate conversions between the channels of both ADCs, replaces the
+ * single channel pattern set by i2s_adc_enable(). Each I2S sample is one
+ * conversion so every ADC is sampled at half the I2S rate, ADC1 one I2S
+ * period after ADC0.
+ */
+static esp_err_t adc_scan_pattern()
+{
+	adc_digi_pattern_table_t pattern[ADC_COUNT];
+
+	for(int i = 0; i < ADC_COUNT; i++)
+	{
+		pattern[i].val = 0;
+		pattern[i].atten = ADC_ATTEN_DB_11;
+		pattern[i].bit_width = ADC_WIDTH_BIT_12;
+		pattern[i].channel = adc_channel[i];
+	}
+
+	/* As i2s_set_adc_mode() but with both channels in the table */
+	adc_digi_config_t config =
+	{
+		.conv_limit_en = 1,
+		.conv_limit_num = 255,
+		.adc1_pattern_len = ADC_COUNT,
+		.adc1_pattern = pattern,
+		.conv_mode = ADC_CONV_SINGLE_UNIT_1,
+		.format = ADC_DIGI_FORMAT_12BIT
+	};
+
+	return adc_digi_controller_config(&config);
+}
+
+static void adc_trig_stop()
+{
+	i2s_stop(I2S_NUM_0);
+	i2s_adc_disable(I2S_NUM_0);
+
+	hci_free_tx_slot(adc_tx_slot);
+	adc_tx_slot = -1;
+
+	adc_ring_free();
+	adc_spectrum_free();
+
+	/* A complete batch is kept for trig zoom until the next trig or trig off */
+	if(!adc_capture_complete())
+		adc_capture_free();
+}
+
+static void adc_log_send()
+{
+	int len = adc_log.len;
+
+	adc_log.len = 0;
+
+	/* Record size estimate, ASCII: "@<time> ADC0 periodic 1000000 256\n" + values + "\n" */
+	int size = hci_binary_mode() ? 24 + 2 * len : 48 + 3 * len;
+
+	if(len == 0 || hci_tx_slot_take(adc_tx_slot, size) < 0)
+		return;
+
+	if(hci_binary_mode())
+	{
+		/* <time (u64 le)> <adc> <period (u32 le)> <value (u16 le)>... */
+		uint8_t buf[8 + 1 + 4 + 2 * ADC_LOG_BATCH];
+		int n = 0;
+
+		for(int i = 0; i < 8; i++)
+			buf[n++] = (adc_log.time >> (8 * i)) & 0xff;
+
+		buf[n++] = adc_log.adc;
+
+		for(int i = 0; i < 4; i++)
+			buf[n++] = (adc_log.period >> (8 * i)) & 0xff;
+
+		for(int i = 0; i < len; i++)
+		{
+			buf[n++] = adc_log.values[i] & 0xff;
+			buf[n++] = adc_log.values[i] >> 8;
+		}
+
+		hci_send_record(HCI_RECORD_ADC_PERIODIC, buf, n);
+		return;
+	}
+
+	char buf[48 + 3 * ADC_LOG_BATCH];
+	char *p = buf;
+
+	p = fmt_timestamp(p, adc_log.time);
+	p = fmt_str(p, "ADC");
+	p = fmt_uint(p, adc_log.adc);
+	p = fmt_str(p, " periodic ");
+	p = fmt_uint(p, adc_log.period);
+	*p++ = ' ';
+	p = fmt_int(p, len);
+	*p++ = '\n';
+	p = fmt_hex12(p, adc_log.values, len);
+	*p++ = '\n';
+
+	hci_print_bytes((uint8_t*)buf, p - buf);
+}
+
+static void adc_log_value(uint16_t value, uint64_t time)
+{
+	if(adc_log.len == 0)
+		adc_log.time = time;
+
+	adc_log.values[adc_log.len++] = value;
+
+	/* Send when full or if the next value is more than 100 ms after the first */
+	if(adc_log.len == ADC_LOG_BATCH ||
+	   time + adc_log.period - adc_log.time >= 100000)
+		adc_log_send();
+}
+
+/* Average and decimate one DMA buffer, block_end is when it was received */
+static void adc_log_block(const uint16_t *values, int samples, uint64_t block_end)
+{
+	for(int i = 0; i < samples; i++)
+	{
+		adc_log.count += 1;
+
+		if(adc_log.count > adc_log.decimation - adc_log.average)
+			adc_log.sum += values[i];
+
+		if(adc_log.count == adc_log.decimation)
+		{
+			uint64_t time = block_end -
+				(uint64_t)(samples - 1 - i) * 1000000 / adc_log.sample_rate;
+
+			adc_log_value((adc_log.sum + adc_log.average / 2) / adc_log.average, time);
+
+			adc_log.count = 0;
+			adc_log.sum = 0;
+		}
+	}
+}
+
+static void adc_stream_send(uint64_t time, const uint16_t *samples, int count)
+{
+	/* Record size estimate, ASCII: "@<time> ADC0 stream <seq> <lost>\n" + samples + "\n" */
+	int size = hci_binary_mode() ? 32 + 3 * count / 2 : 48 + 3 * count;
+
+	if(hci_tx_slot_take(adc_tx_slot, size) < 0)
+	{
+		adc_stream.seq += 1;
+		adc_stream.lost += 1;
+		return;
+	}
+
+	if(hci_binary_mode())
+	{
+		/* <time (u64 le)> <adc> <seq (u32 le)> <lost (u32 le)> <packed samples>... */
+		uint8_t buf[8 + 1 + 4 + 4 + 3 * ADC_STREAM_RECORD / 2];
+		int n = 0;
+
+		for(int i = 0; i < 8; i++)
+			buf[n++] = (time >> (8 * i)) & 0xff;
+
+		buf[n++] = adc_stream.adc;
+
+		for(int i = 0; i < 4; i++)
+			buf[n++] = (adc_stream.seq >> (8 * i)) & 0xff;
+
+		for(int i = 0; i < 4; i++)
+			buf[n++] = (adc_stream.lost >> (8 * i)) & 0xff;
+
+		n += adc_pack12(&buf[n], samples, count, 1);
+
+		hci_send_record(HCI_RECORD_ADC_STREAM, buf, n);
+	}
+	else
+	{
+		char buf[48 + 3 * ADC_STREAM_RECORD];
+		char *p = buf;
+
+		p = fmt_timestamp(p, time);
+		p = fmt_str(p, "ADC");
+		p = fmt_uint(p, adc_stream.adc);
+		p = fmt_str(p, " stream ");
+		p = fmt_uint(p, adc_stream.seq);
+		*p++ = ' ';
+		p = fmt_uint(p, adc_stream.lost);
+		*p++ = '\n';
+		p = fmt_hex12(p, samples, count);
+		*p++ = '\n';
+
+		hci_print_bytes((uint8_t*)buf, p - buf);
+	}
+
+	adc_stream.seq += 1;
+	adc_stream.lost = 0;
+}
+
+/* Send one DMA buffer, block_end is when it was received */
+static void adc_stream_block(uint16_t *samples, int count, uint64_t block_end)
+{
+	uint32_t decimation = adc_filter_decimation(&adc_stream.filter.config);
+	uint32_t rate = adc_stream.sample_rate / decimation;
+	int records = (count / decimation + ADC_STREAM_RECORD - 1) / ADC_STREAM_RECORD;
+	uint32_t block_us = (uint64_t)count * 1000000 / adc_stream.sample_rate;
+
+	/* DMA buffers are overwritten if this thread does not keep up */
+	if(adc_stream.last_block &&
+	   block_end - adc_stream.last_block > block_us * 3 / 2)
+	{
+		uint32_t blocks =
+			(block_end - adc_stream.last_block + block_us / 2) / block_us - 1;
+
+		adc_stream.seq += blocks * records;
+		adc_stream.lost += blocks * records;
+	}
+
+	adc_stream.last_block = block_end;
+
+	/* Filter in place and round back to 12 bits for the record format */
+	if(adc_stream.filter.config.type != ADC_FILTER_NONE)
+	{
+		count = adc_filter_run(&adc_stream.filter, samples, samples, count);
+
+		for(int i = 0; i < count; i++)
+			samples[i] = (samples[i] + (1 << (ADC_FILTER_FRACTION - 1))) >>
+			             ADC_FILTER_FRACTION;
+	}
+
+	for(int i = 0; i < count; i += ADC_STREAM_RECORD)
+	{
+		int len = count - i < ADC_STREAM_RECORD ? count - i : ADC_STREAM_RECORD;
+		uint64_t time = block_end - (uint64_t)(count - 1 - i) * 1000000 / rate;
+
+		adc_stream_send(time, &samples[i], len);
+	}
+}
+
+static void adc_measure_print()
+{
+	struct adc_measure *m = &adc_measure.stats;
+	uint32_t span = m->last_edge - m->first_edge;
+	float frequency = 0;
+	float duty = 0;
+	float rise = 0;
+
+	if(m->edges > 1)
+	{
+		frequency = (float)(m->edges - 1) * adc_measure.rate / span;
+		duty = 100.0f * m->high_at_last_edge / span;
+	}
+
+	if(m->rises)
+		rise = (float)m->rise_sum / m->rises * 1000000 / adc_measure.rate;
+
+	hci_set_tag(adc_measure.tag);
+	printf("OK %u %u %.1f %.1f %u %.2f %.1f %.2f\n",
+	       m->min, m->max,
+	       (double)m->sum / m->count,
+	       sqrt((double)m->sum_squares / m->count),
+	       m->max - m->min, frequency, duty, rise);
+	hci_set_tag(HCI_NO_TAG);
+}
+
+/*******************************************************************************
+ * Add values to the measurement
+ *
+ * Return value: 1 when all samples are measured
+ ******************************************************************************/
+static int adc_measure_values(const uint16_t *values, int count)
+{
+	int left = adc_measure.samples - adc_measure.stats.count;
+
+	if(count > left)
+		count = left;
+
+	adc_measure_block(&adc_measure.stats, values, count);
+
+	return adc_measure.stats.count == adc_measure.samples;
+}
 
-				if(bytes_read == 0)
-					break;
+/*******************************************************************************
+ * Add values to the frame, it is transformed when full. The rest of the
+ * buffer is dropped then, DMA buffers may be lost during the transform and a
+ * frame must be continuous.
+ *
+ * Return value: 1 when all frames are done
+ ******************************************************************************/
+static int adc_spectrum_values(const uint16_t *values, int count)
+{
+	int points = 1 << adc_spectrum.log2n;
+
+	for(int i = 0; i < count; i++)
+	{
+		adc_spectrum.data[2 * adc_spectrum.fill++] = values[i];
+
+		if(adc_spectrum.fill < points)
+			continue;
+
+		adc_spectrum_frame(
+			adc_spectrum.power, adc_spectrum.data, adc_spectrum.window,
+			adc_spectrum.log2n);
+		adc_spectrum.fill = 0;
+		adc_spectrum.frame += 1;
+
+		return adc_spectrum.frame == adc_spectrum.frames;
+	}
+
+	return 0;
+}
+
+/* Average power of bin in dB relative to a full scale sine */
+static float adc_spectrum_db(int bin)
+{
+	int points = 1 << adc_spectrum.log2n;
+
+	/* Values are scaled by 16, a sine of amplitude a gives a * 16 * points * gain / 2 */
+	float full = 2048.0f * 16 * points * adc_spectrum.gain / 2;
+	float power = adc_spectrum.power[bin] / adc_spectrum.frames;
+
+	return 10 * log10f(power / (full * full) + 1e-12f);
+}
+
+static void adc_spectrum_print()
+{
+	int points = 1 << adc_spectrum.log2n;
+	int bins = points / 2 + 1;
+	float resolution = (float)adc_spectrum.rate / points;
+
+	hci_set_tag(adc_spectrum.tag);
+
+	if(adc_spectrum.peaks)
+	{
+		int peaks[32];
+		int count = adc_spectrum_peaks(
+			adc_spectrum.power, bins, peaks, adc_spectrum.peaks);
+		/* " <frequency> <dB>" per peak, frequencies are below 10 MHz */
+		char line[32 * 18 + 2];
+		char *p = line;
+
+		for(int i = 0; i < count; i++)
+		{
+			int bin = peaks[i];
+			float offset = 0;
+
+			/* Parabola through the peak and its neighbours in dB */
+			if(bin + 1 < bins)
+			{
+				float a = adc_spectrum_db(bin - 1);
+				float b = adc_spectrum_db(bin);
+				float c = adc_spectrum_db(bin + 1);
+
+				if(a - 2 * b + c < 0)
+					offset = 0.5f * (a - c) / (a - 2 * b + c);
+			}
+
+			*p++ = ' ';
+			p = fmt_tenths(p, lrintf(10 * (bin + offset) * resolution));
+			*p++ = ' ';
+			p = fmt_tenths(p, lrintf(10 * adc_spectrum_db(bin)));
+		}
+
+		*p++ = '\n';
+		*p = 0;
+
+		printf("OK %.3f%s", resolution, line);
+	}
+	else
+	{
+		/* "-120.0 " per bin */
+		char line[7 * ADC_SPECTRUM_LINE + 1];
+
+		printf("OK %d %.3f\n", bins, resolution);
+
+		for(int i = 0; i < bins; i += ADC_SPECTRUM_LINE)
+		{
+			char *p = line;
+
+			for(int j = i; j < bins && j < i + ADC_SPECTRUM_LINE; j++)
+			{
+				p = fmt_tenths(p, lrintf(10 * adc_spectrum_db(j)));
+				*p++ = ' ';
+			}
+
+			p[-1] = '\n';
+			*p = 0;
+
+			/* One write per line, room for it is left before the next */
+			while(hci_tx_slot_poll(-1, 2 * (p - line)) < 0)
+				vTaskDelay(1);
+
+			printf("%s", line);
+		}
+	}
+
+	hci_set_tag(HCI_NO_TAG);
+}
+
+/* Use of the I2S ADC, owned by adc_trig_thread */
+enum adc_state
+{
+	STATE_TRIG_OFF,
+	STATE_TRIG_SEARCHING,
+	STATE_TRIG_FOUND,
+	STATE_PERIODIC,
+	STATE_STREAM,
+	STATE_MEASURE,
+	STATE_SPECTRUM
+};
+
+/*******************************************************************************
+ * Stop the current use of the I2S ADC before another is started. Logged
+ * values are sent and a pending measure or spectrum is answered.
+ ******************************************************************************/
+static void adc_state_stop(enum adc_state state)
+{
+	int tag = hci_get_tag();
+
+	if(state == STATE_TRIG_OFF)
+		return;
+
+	if(state == STATE_PERIODIC)
+		adc_log_send();
+
+	if(state == STATE_MEASURE || state == STATE_SPECTRUM)
+	{
+		hci_set_tag(state == STATE_MEASURE ? adc_measure.tag : adc_spectrum.tag);
+		printf(EABORTED);
+		hci_set_tag(tag);
+	}
+
+	adc_trig_stop();
+}
+
+void adc_trig_thread(void *parameters)
+{
+	esp_err_t err;
+	uint32_t m = 0;
+	uint16_t n = 0;
+	struct adc_trig trig = { .mode = ADC_TRIG_ANY };
+	uint32_t segment_holdoff = 0;
+	uint32_t holdoff = 0; /* Values left to skip before searching */
+	int trig_len = 0;
+	int trig_adc = 0; /* Index of triggering ADC in a pair when scanning */
+
+	/*
+	 * <--buf head-2--><--buf head-1--><---buf head--->
+	 *          <-------m------->T<-----n----->
+	 *                          <---m--->T<-----n----->
+	 *                                <-m->T<-----n----->
+	 *
+	 * On trig the values before the latest buffer are taken from the ring,
+	 * the rest are sent from each buffer as it is received. When scanning
+	 * positions count pairs of values, one of each ADC.
+	 */
+
+	esp_task_wdt_delete(xTaskGetCurrentTaskHandle());
+
+	enum adc_state state = STATE_TRIG_OFF;
+
+	while(1)
+	{
+		/*
+		 * QueueSet implementation causes abort() if it is ever becoming full
+		 * so we do not use it
+		 */
+		i2s_event_t i2s_event;
+		if(xQueueReceive(i2s_queue, &i2s_event, 10))
+		{
+			if(i2s_event.type == I2S_EVENT_RX_DONE &&
+			   (state == STATE_PERIODIC || state == STATE_STREAM ||
+			    state == STATE_MEASURE || state == STATE_SPECTRUM))
+			{
+				uint64_t time = timebase_now();
 
-				/* Store transformed values */
-				for(int i = 0; i < bytes_read/2; i += 2)
+				size_t bytes_read;
+				union
+				{
+					uint32_t words[512];
+					uint16_t values[1024];
+				} buf;
+				i2s_read(I2S_NUM_0, buf.words, sizeof(buf), &bytes_read, 0);
+
+				/* Unpack in place */
+				adc_unpack(buf.values, buf.words, bytes_read / 2);
+
+				if(state == STATE_PERIODIC)
+					adc_log_block(buf.values, bytes_read / 2, time);
+				else if(state == STATE_STREAM)
+					adc_stream_block(buf.values, bytes_read / 2, time);
+				else if(state == STATE_MEASURE)
+				{
+					if(bytes_read && adc_measure_values(buf.values, bytes_read / 2))
+					{
+						adc_trig_stop();
+						state = STATE_TRIG_OFF;
+						adc_measure_print();
+					}
+				}
+				else if(adc_spectrum_values(buf.values, bytes_read / 2))
 				{
-					/*
-					 * We need to change byte order, probably due to I2S
-					 * FIFO being 32-bit and we read 16-bits at a time
-					 */
-					stored_values[current_buf][i] = ((buf[2*i+3] & 0xf) << 4) | (buf[2*i+2] >> 4);
-					stored_values[current_buf][i+1] = ((buf[2*i+1] & 0xf) << 4) | (buf[2*i] >> 4);
+					/* Print before the buffers are freed */
+					adc_spectrum_print();
+					adc_trig_stop();
+					state = STATE_TRIG_OFF;
 				}
+			}
+			else if(i2s_event.type == I2S_EVENT_RX_DONE &&
+			        (state == STATE_TRIG_SEARCHING || state == STATE_TRIG_FOUND))
+			{
+				struct adc_block *block = adc_ring_next();
+				size_t bytes_read;
+
+				block->time = timebase_now();
+				i2s_read(I2S_NUM_0, block->words, sizeof(block->words), &bytes_read, 0);
 
-				if(state == STATE_TRIG_SEARCHING)
+				/* Nothing read, the block is not kept in the ring */
+				if(bytes_read == 0)
 				{
-					/* Search for trig condition */
-					uint8_t v0;
-					int i;
+					adc_ring.head = (adc_ring.head + adc_ring.count - 1) %
+						adc_ring.count;
+					continue;
+				}
 
-					int other_buf = 1 - current_buf;
-					if(!first_buf)
+				if(adc_ring.filled < adc_ring.count)
+					adc_ring.filled += 1;
+
+				uint16_t *values = block->values;
+				int channels = adc_trig_channels;
+				int block_len = adc_trig_block;
+				int first_buf = adc_ring.filled == 1;
+				int pos = 0; /* Next value, or pair, to handle */
+				int found = -1;
+				int searched = 0; /* found is valid from pos */
+
+				/* Unpack 12-bit values in place and search for trig condition */
+				if(state == STATE_TRIG_SEARCHING && holdoff == 0 && channels > 1)
+				{
+					/* Pairs are sorted by channel number, ADC0 first */
+					if(first_buf)
 					{
-						i = 0;
-						v0 = stored_values[other_buf][1023];
+						adc_unpack_scan(
+							NULL, 0, values, block->words, bytes_read / 2,
+							adc_channel[0]);
+						adc_trig_reset(&trig, values[trig_adc]);
+						found = adc_trig_search_stride(
+							&trig, &values[channels + trig_adc], block_len - 1,
+							channels);
+
+						if(found >= 0)
+							found += 1;
 					}
 					else
-					{
-						i = 1;
-						v0 = stored_values[current_buf][0];
-					}
+						found = adc_unpack_scan(
+							&trig, trig_adc, values, block->words, bytes_read / 2,
+							adc_channel[0]);
 
-					for(; i < 1024; i++)
-					{
-						uint8_t v1 = stored_values[current_buf][i];
+					searched = 1;
+				}
+				else if(state == STATE_TRIG_SEARCHING && holdoff == 0)
+				{
+					/* Trigger state is kept between buffers */
+					if(first_buf)
+						adc_trig_reset(&trig, (block->words[0] >> 16) & 0xfff);
 
-						if(v1 == value ||
-						   (v1 > value && v0 < value) ||
-						   (v1 < value && v0 > value))
-						{
-							state = STATE_TRIG_FOUND;
-							trig_len = 0;
-
-
-							int len0 = m - i; /* Points in last buffer */
-							int start = 0;
-							if(len0 > 0)
-							{
-								if(!first_buf)
-									adc_send_trig_data(0, stored_values[other_buf] + 1024 - len0, len0);
-								trig_len += len0;
-							}
-							else
-								start = i - m;
-
-							if(m + n - trig_len > (1024-start))
-							{
-								adc_send_trig_data(
-									trig_len,
-									&stored_values[current_buf][start],
-									1024-start);
-								trig_len += 1024;
-							}
-							else
-							{
-								adc_send_trig_data(
-									trig_len,
-									&stored_values[current_buf][start],
-									m + n - trig_len);
-
-								i2s_stop(I2S_NUM_0);
-								i2s_adc_disable(I2S_NUM_0);
-								state = STATE_TRIG_OFF;
-							}
+					found = adc_unpack_trig(&trig, values, block->words, bytes_read / 2);
+					searched = 1;
 
-							break;
-						}
+					/* On the first buffer start comparing at the second value */
+					if(first_buf && found == 0)
+					{
+						found = adc_trig_search(&trig, &values[1], 1023);
 
-						v0 = v1;
+						if(found >= 0)
+							found += 1;
 					}
 				}
-				else if(state == STATE_TRIG_FOUND)
+				else if(channels > 1)
+					adc_unpack_scan(
+						NULL, 0, values, block->words, bytes_read / 2,
+						adc_channel[0]);
+				else
+					adc_unpack(values, block->words, bytes_read / 2);
+
+				/* Several segments may start and end in one buffer */
+				while(pos < block_len)
 				{
-					if(m + n - trig_len > 1024)
+					if(state == STATE_TRIG_SEARCHING && holdoff > 0)
 					{
-						adc_send_trig_data(trig_len, stored_values[current_buf], 1024);
-						trig_len += 1024;
+						int skip = holdoff < block_len - pos ? holdoff : block_len - pos;
+
+						holdoff -= skip;
+						pos += skip;
+
+						if(holdoff == 0)
+							adc_trig_reset(&trig, values[(pos - 1) * channels + trig_adc]);
 					}
-					else
+					else if(state == STATE_TRIG_SEARCHING)
 					{
-						adc_send_trig_data(trig_len, stored_values[current_buf], m + n - trig_len);
+						if(!searched)
+						{
+							found = adc_trig_search_stride(
+								&trig, &values[pos * channels + trig_adc],
+								block_len - pos, channels);
 
-						i2s_stop(I2S_NUM_0);
-						i2s_adc_disable(I2S_NUM_0);
-						state = STATE_TRIG_OFF;
+							if(found >= 0)
+								found += pos;
+						}
+
+						searched = 0;
+
+						if(found < 0)
+							break;
+
+						state = STATE_TRIG_FOUND;
+
+						int len0 = m - found; /* Values in earlier buffers */
+						uint64_t time = adc_sample_time(block->time, found, adc_trig_rate);
+
+						trig_len = 0;
+
+						if(len0 > 0)
+						{
+							int history = (adc_ring.filled - 1) * block_len;
+							int missing = len0 > history ? len0 - history : 0;
+
+							adc_capture_begin(time, missing);
+							adc_ring_history(missing, len0);
+
+							trig_len = len0;
+							pos = 0;
+						}
+						else
+						{
+							adc_capture_begin(time, 0);
+							pos = found - m;
+						}
 					}
-				}
+					else if(state == STATE_TRIG_FOUND)
+					{
+						int len = m + n - trig_len;
 
-				/* Clear first_buf since other_buf is now always filled */
-				first_buf = 0;
+						if(len > block_len - pos)
+							len = block_len - pos;
 
-				/* Switch buffer to use */
-				if(current_buf == 1)
-					current_buf = 0;
-				else
-					current_buf += 1;
+						adc_capture_block(block, pos, trig_len, len);
+
+						trig_len += len;
+						pos += len;
+
+						if(trig_len < m + n)
+							continue;
+
+						if(adc_capture_end())
+						{
+							adc_capture_flush();
+							adc_trig_stop();
+							state = STATE_TRIG_OFF;
+						}
+						else
+						{
+							/* Re-arm */
+							state = STATE_TRIG_SEARCHING;
+							holdoff = segment_holdoff;
+
+							if(holdoff == 0)
+								adc_trig_reset(&trig, values[(pos - 1) * channels + trig_adc]);
+						}
+					}
+					else
+						break;
+				}
 			}
 		}
 
@@ -607,44 +2467,309 @@ void adc_trig_thread(void *parameters)
 
 		if(xQueueReceive(cmd_queue, &cmd_event, 0))
 		{
+			hci_set_tag(cmd_event.tag);
+
 			if(cmd_event.event == EVENT_CMD_TRIG_OFF)
 			{
-				i2s_stop(I2S_NUM_0);
-				i2s_adc_disable(I2S_NUM_0);
+				adc_trig_stop();
+				adc_capture_free();
 				state = STATE_TRIG_OFF;
 			}
+			else if(cmd_event.event == EVENT_CMD_ZOOM)
+			{
+				/* Values are sent from the batch, nothing else may use I2S */
+				if(state == STATE_TRIG_OFF)
+					adc_capture_zoom(
+						cmd_event.zoom.segment, cmd_event.zoom.start,
+						cmd_event.zoom.len);
+				else
+					printf(EINVAL);
+			}
 			else if(cmd_event.event == EVENT_CMD_TRIG)
 			{
-				/* TODO: check if we're already triggering */
+				adc_state_stop(state);
+				state = STATE_TRIG_OFF;
+
+				adc_trig_channels = cmd_event.trig.scan ? ADC_COUNT : 1;
+				adc_trig_block = 1024 / adc_trig_channels;
+
+				if(adc_ring_alloc(cmd_event.trig.m) < 0 ||
+				   adc_capture_alloc(
+					cmd_event.trig.segments, cmd_event.trig.mode,
+					cmd_event.trig.m, cmd_event.trig.m + cmd_event.trig.n) < 0)
+				{
+					adc_ring_free();
+					adc_capture_free();
+					printf(ENOMEM);
+					hci_set_tag(HCI_NO_TAG);
+					continue;
+				}
+
 				i2s_set_adc_mode(ADC_UNIT_1, adc_channel[0]);
 
 				err = i2s_set_clk(
 					I2S_NUM_0,
-					cmd_event.trig.sample_rate,
+					cmd_event.trig.sample_rate * adc_trig_channels,
 					16, I2S_CHANNEL_MONO);
-				float clk = 16 * i2s_get_clk(I2S_NUM_0);
-				printf("ADC0 clk: %f\n", clk);
 
 				if(err != ESP_OK)
 				{
+					adc_ring_free();
+					adc_capture_free();
 					printf("ERR Trig settings error\n");
-					return;
+					hci_set_tag(HCI_NO_TAG);
+					continue;
 				}
 
-				value = cmd_event.trig.value;
+				/* One DMA buffer every 20 ms, a record header more per ADC */
+				hci_free_tx_slot(adc_tx_slot);
+				adc_tx_slot = hci_alloc_tx_slot(
+					20, 3120 + 64 * (adc_trig_channels - 1), HCI_TX_PRIO_NORMAL,
+					"adc");
+
+				adc_trig_rate = cmd_event.trig.sample_rate;
+				trig = cmd_event.trig.trigger;
 				m = cmd_event.trig.m;
 				n = cmd_event.trig.n;
-				first_buf = 1;
-
-				memset(stored_values, 0, 2*1024);
-				current_buf = 0;
+				segment_holdoff = cmd_event.trig.holdoff;
 				trig_len = 0;
+				holdoff = 0;
+				trig_adc = adc_trig_channels > 1 ? cmd_event.trig.scan_adc : 0;
+				adc_envelope.bucket = cmd_event.trig.mode == ADC_CAPTURE_AVERAGE ?
+					0 : cmd_event.trig.envelope;
 
 				i2s_start(I2S_NUM_0);
 				i2s_adc_enable(I2S_NUM_0); /* TODO: locks ADC */
 
+				if(adc_trig_channels > 1 && adc_scan_pattern() != ESP_OK)
+				{
+					adc_trig_stop();
+					adc_capture_free();
+					printf("ERR Trig scan settings error\n");
+					hci_set_tag(HCI_NO_TAG);
+					continue;
+				}
+
+				/* The only response, armed */
+				printf("OK\nADC0 clk: %f\n", 16 * i2s_get_clk(I2S_NUM_0));
+
 				state = STATE_TRIG_SEARCHING;
 			}
+			else if(cmd_event.event == EVENT_CMD_PERIODIC_OFF)
+			{
+				if(state == STATE_PERIODIC)
+				{
+					adc_log_send();
+					adc_trig_stop();
+					state = STATE_TRIG_OFF;
+				}
+
+				printf("OK\n");
+			}
+			else if(cmd_event.event == EVENT_CMD_PERIODIC)
+			{
+				adc_state_stop(state);
+				state = STATE_TRIG_OFF;
+
+				uint32_t rate = cmd_event.periodic.rate;
+
+				adc_log.adc = cmd_event.periodic.adc;
+				adc_log.period = 1000000 / rate;
+				adc_log.sample_rate = rate * cmd_event.periodic.decimation;
+				adc_log.decimation = cmd_event.periodic.decimation;
+				adc_log.average = cmd_event.periodic.average;
+				adc_log.count = 0;
+				adc_log.sum = 0;
+				adc_log.len = 0;
+
+				i2s_set_adc_mode(ADC_UNIT_1, adc_channel[adc_log.adc]);
+
+				err = i2s_set_clk(
+					I2S_NUM_0,
+					adc_log.sample_rate,
+					16, I2S_CHANNEL_MONO);
+
+				if(err != ESP_OK)
+				{
+					printf("ERR Periodic settings error\n");
+					hci_set_tag(HCI_NO_TAG);
+					continue;
+				}
+
+				/* Values and record headers for 100 ms */
+				adc_tx_slot = hci_alloc_tx_slot(
+					100, 3 * (rate / 10 + 1) + 48 * (rate / 2560 + 1),
+					HCI_TX_PRIO_NORMAL, "adc");
+
+				if(adc_tx_slot < 0)
+				{
+					printf(ENOTIME);
+					hci_set_tag(HCI_NO_TAG);
+					continue;
+				}
+
+				i2s_start(I2S_NUM_0);
+				i2s_adc_enable(I2S_NUM_0);
+
+				state = STATE_PERIODIC;
+				printf("OK\n");
+			}
+			else if(cmd_event.event == EVENT_CMD_STREAM_OFF)
+			{
+				if(state == STATE_STREAM)
+				{
+					adc_trig_stop();
+					state = STATE_TRIG_OFF;
+				}
+
+				printf("OK\n");
+			}
+			else if(cmd_event.event == EVENT_CMD_STREAM)
+			{
+				adc_state_stop(state);
+				state = STATE_TRIG_OFF;
+
+				/* Bytes of a full record in the current output mode */
+				uint32_t record = hci_binary_mode() ?
+				                  32 + 3 * ADC_STREAM_RECORD / 2 :
+				                  48 + 3 * ADC_STREAM_RECORD;
+				uint32_t rate = cmd_event.stream.rate;
+				uint32_t decimation =
+					adc_filter_decimation(&cmd_event.stream.filter);
+
+				/* Without a rate ask for the whole link and use what is granted */
+				uint64_t bytes = rate ?
+				                 (uint64_t)rate * record / ADC_STREAM_RECORD / 10 :
+				                 UINT16_MAX;
+
+				if(bytes > UINT16_MAX)
+					bytes = UINT16_MAX;
+
+				if(bytes < 2 * record)
+					bytes = 2 * record;
+
+				adc_tx_slot = hci_alloc_tx_slot(100, bytes, HCI_TX_PRIO_LOW, "adc");
+
+				if(!rate)
+				{
+					rate = (uint64_t)hci_tx_slot_rate(adc_tx_slot) *
+					       ADC_STREAM_RECORD / record;
+
+					if(rate > ADC_I2S_MAX_RATE / decimation)
+						rate = ADC_I2S_MAX_RATE / decimation;
+				}
+
+				if(adc_tx_slot < 0 || rate * decimation < ADC_I2S_MIN_RATE)
+				{
+					hci_free_tx_slot(adc_tx_slot);
+					adc_tx_slot = -1;
+					printf(ENOTIME);
+					hci_set_tag(HCI_NO_TAG);
+					continue;
+				}
+
+				i2s_set_adc_mode(ADC_UNIT_1, adc_channel[cmd_event.stream.adc]);
+
+				err = i2s_set_clk(I2S_NUM_0, rate * decimation, 16, I2S_CHANNEL_MONO);
+
+				if(err != ESP_OK)
+				{
+					hci_free_tx_slot(adc_tx_slot);
+					adc_tx_slot = -1;
+					printf("ERR Stream settings error\n");
+					hci_set_tag(HCI_NO_TAG);
+					continue;
+				}
+
+				adc_stream.adc = cmd_event.stream.adc;
+				adc_stream.sample_rate = rate * decimation;
+				adc_filter_reset(&adc_stream.filter, &cmd_event.stream.filter);
+				adc_stream.seq = 0;
+				adc_stream.lost = 0;
+				adc_stream.last_block = 0;
+
+				i2s_start(I2S_NUM_0);
+				i2s_adc_enable(I2S_NUM_0);
+
+				state = STATE_STREAM;
+				printf("OK %u\n", rate);
+			}
+			else if(cmd_event.event == EVENT_CMD_MEASURE)
+			{
+				adc_state_stop(state);
+				state = STATE_TRIG_OFF;
+
+				i2s_set_adc_mode(ADC_UNIT_1, adc_channel[0]);
+
+				err = i2s_set_clk(
+					I2S_NUM_0,
+					cmd_event.measure.rate,
+					16, I2S_CHANNEL_MONO);
+
+				if(err != ESP_OK)
+				{
+					printf("ERR Measure settings error\n");
+					hci_set_tag(HCI_NO_TAG);
+					continue;
+				}
+
+				adc_measure_reset(&adc_measure.stats);
+				adc_measure.rate = cmd_event.measure.rate;
+				adc_measure.samples = cmd_event.measure.samples;
+				adc_measure.tag = cmd_event.tag;
+
+				i2s_start(I2S_NUM_0);
+				i2s_adc_enable(I2S_NUM_0);
+
+				/* The result is the response */
+				state = STATE_MEASURE;
+			}
+			else if(cmd_event.event == EVENT_CMD_SPECTRUM)
+			{
+				adc_state_stop(state);
+				state = STATE_TRIG_OFF;
+
+				if(adc_spectrum_alloc(cmd_event.spectrum.points) < 0)
+				{
+					printf(ENOMEM);
+					hci_set_tag(HCI_NO_TAG);
+					continue;
+				}
+
+				i2s_set_adc_mode(ADC_UNIT_1, adc_channel[0]);
+
+				err = i2s_set_clk(
+					I2S_NUM_0,
+					cmd_event.spectrum.rate,
+					16, I2S_CHANNEL_MONO);
+
+				if(err != ESP_OK)
+				{
+					adc_spectrum_free();
+					printf("ERR Spectrum settings error\n");
+					hci_set_tag(HCI_NO_TAG);
+					continue;
+				}
+
+				adc_spectrum.rate = cmd_event.spectrum.rate;
+				adc_spectrum.log2n = adc_fft_log2(cmd_event.spectrum.points);
+				adc_spectrum.frames = cmd_event.spectrum.frames;
+				adc_spectrum.frame = 0;
+				adc_spectrum.fill = 0;
+				adc_spectrum.peaks = cmd_event.spectrum.peaks;
+				adc_spectrum.gain = adc_window_build(
+					adc_spectrum.window, cmd_event.spectrum.points,
+					cmd_event.spectrum.window);
+				adc_spectrum.tag = cmd_event.tag;
+
+				i2s_start(I2S_NUM_0);
+				i2s_adc_enable(I2S_NUM_0);
+
+				/* The result is the response */
+				state = STATE_SPECTRUM;
+			}
+
+			hci_set_tag(HCI_NO_TAG);
 		}
 	}
 }
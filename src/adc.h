@@ -1,5 +1,7 @@
 #pragma once
 
+#include "command.h"
+
 enum adc
 {
 	ADC0 = 0,
@@ -10,5 +12,7 @@ enum adc
 int adc_init();
 uint16_t adc_single();
 void adc_print_value(enum adc, uint16_t raw_value);
-void adc_command(int adc);
+void adc_calibration_changed();
 void adc_trig_thread(void *parameters);
+
+extern const struct command_table adc_command_table;
@@ -0,0 +1,871 @@
+/*
+ *  This file is part of SWT21 lab kit firmware.
+ *
+ *  SWT21 lab kit firmware is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  SWT21 lab kit firmware is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with SWT21 lab kit firmware.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ *  Copyright 2021 Joachim Lublin, Binäs Teknik AB
+ */
+
+#include <math.h>
+
+#include "adc_kernel.h"
+
+/* Two 16-bit lanes in a word */
+#define LANE_ONES 0x00010001
+#define LANE_SIGNS 0x80008000
+#define LANE_VALUES 0x0fff0fff
+
+/* Values of adc_trig.armed */
+enum
+{
+	ARMED_NO = 0,
+	ARMED_BELOW, /* Seen below the low threshold */
+	ARMED_ABOVE, /* Seen above the high threshold, or inside for leave */
+	PULSE_STARTED, /* In pulse, not yet above the high threshold */
+	PULSE_HIGH /* In pulse and seen above the high threshold */
+};
+
+/*******************************************************************************
+ * Unpack 12-bit values from DMA words
+ ******************************************************************************/
+void adc_unpack(uint16_t *values, const uint32_t *words, int count)
+{
+	for(int i = 0; i < count; i += 2)
+	{
+		uint32_t w = words[i / 2] & LANE_VALUES;
+
+		values[i] = w >> 16;
+		values[i + 1] = w & 0xffff;
+	}
+}
+
+/*******************************************************************************
+ * Clear the trigger state, prev is the value before the first
+ ******************************************************************************/
+void adc_trig_reset(struct adc_trig *trig, uint16_t prev)
+{
+	trig->prev = prev;
+	trig->armed = ARMED_NO;
+	trig->count = 0;
+}
+
+static int clamp(int value)
+{
+	return value < 0 ? 0 : value > 4095 ? 4095 : value;
+}
+
+/*******************************************************************************
+ * Evaluate one value
+ *
+ * Return value: 1 if the trigger fires on this value
+ ******************************************************************************/
+static int adc_trig_step(struct adc_trig *trig, uint16_t v)
+{
+	int level = trig->level;
+	int high = trig->high;
+	int low_threshold = level - trig->hysteresis;
+	int high_threshold = level + trig->hysteresis;
+	uint16_t prev = trig->prev;
+	int fire = 0;
+
+	trig->prev = v;
+
+	switch(trig->mode)
+	{
+	case ADC_TRIG_ANY:
+		fire = v == level ||
+		       (v > level && prev < level) ||
+		       (v < level && prev > level);
+		break;
+
+	case ADC_TRIG_RISING:
+	case ADC_TRIG_FALLING:
+	case ADC_TRIG_EITHER:
+		if(trig->mode != ADC_TRIG_FALLING &&
+		   trig->armed == ARMED_BELOW && v >= level)
+			fire = 1;
+
+		if(trig->mode != ADC_TRIG_RISING &&
+		   trig->armed == ARMED_ABOVE && v <= level)
+			fire = 1;
+
+		if(fire)
+			trig->armed = ARMED_NO;
+
+		if(trig->mode != ADC_TRIG_FALLING && v < low_threshold)
+			trig->armed = ARMED_BELOW;
+
+		if(trig->mode != ADC_TRIG_RISING && v > high_threshold)
+			trig->armed = ARMED_ABOVE;
+		break;
+
+	case ADC_TRIG_ENTER:
+		if(trig->armed && v >= level && v <= high)
+		{
+			fire = 1;
+			trig->armed = ARMED_NO;
+		}
+		else if(v < low_threshold || v > high + trig->hysteresis)
+			trig->armed = ARMED_ABOVE;
+		break;
+
+	case ADC_TRIG_LEAVE:
+		if(trig->armed && (v < level || v > high))
+		{
+			fire = 1;
+			trig->armed = ARMED_NO;
+		}
+		else if(v >= high_threshold && v <= high - trig->hysteresis)
+			trig->armed = ARMED_ABOVE;
+		break;
+
+	case ADC_TRIG_WIDER:
+	case ADC_TRIG_NARROWER:
+		if(trig->armed == PULSE_STARTED || trig->armed == PULSE_HIGH)
+		{
+			if(v > high_threshold)
+				trig->armed = PULSE_HIGH;
+
+			if(trig->armed == PULSE_HIGH && v <= level)
+			{
+				/* End of pulse, count is the number of values in it */
+				if(trig->mode == ADC_TRIG_WIDER)
+					fire = trig->count > trig->width;
+				else
+					fire = trig->count < trig->width;
+
+				trig->armed = v < low_threshold ? ARMED_BELOW : ARMED_NO;
+			}
+			else if(trig->armed == PULSE_STARTED && v < low_threshold)
+				trig->armed = ARMED_BELOW; /* Noise, not a pulse */
+			else
+				trig->count += 1;
+		}
+		else if(trig->armed == ARMED_BELOW && v >= level)
+		{
+			trig->armed = v > high_threshold ? PULSE_HIGH : PULSE_STARTED;
+			trig->count = 1;
+		}
+		else if(v < low_threshold)
+			trig->armed = ARMED_BELOW;
+		break;
+	}
+
+	return fire;
+}
+
+/*******************************************************************************
+ * Range of values that can not change the trigger state except counting
+ * pulse width. Empty, low > high, if there is none.
+ ******************************************************************************/
+static void adc_trig_quiet(const struct adc_trig *trig, int *low, int *high)
+{
+	int level = trig->level;
+	int hysteresis = trig->hysteresis;
+
+	*low = 1;
+	*high = 0;
+
+	switch(trig->mode)
+	{
+	case ADC_TRIG_ANY:
+		if(trig->prev > level)
+			*low = level + 1, *high = 4095;
+		else if(trig->prev < level)
+			*low = 0, *high = level - 1;
+		break;
+
+	case ADC_TRIG_RISING:
+		if(trig->armed)
+			*low = 0, *high = level - 1;
+		else
+			*low = clamp(level - hysteresis), *high = 4095;
+		break;
+
+	case ADC_TRIG_FALLING:
+		if(trig->armed)
+			*low = level + 1, *high = 4095;
+		else
+			*low = 0, *high = clamp(level + hysteresis);
+		break;
+
+	case ADC_TRIG_EITHER:
+		if(trig->armed == ARMED_BELOW)
+			*low = 0, *high = level - 1;
+		else if(trig->armed == ARMED_ABOVE)
+			*low = level + 1, *high = 4095;
+		else
+			*low = clamp(level - hysteresis), *high = clamp(level + hysteresis);
+		break;
+
+	case ADC_TRIG_ENTER:
+		if(!trig->armed)
+			*low = clamp(level - hysteresis), *high = clamp(trig->high + hysteresis);
+		else if(trig->prev < level)
+			*low = 0, *high = level - 1;
+		else if(trig->prev > trig->high)
+			*low = trig->high + 1, *high = 4095;
+		break;
+
+	case ADC_TRIG_LEAVE:
+		if(trig->armed)
+			*low = level, *high = trig->high;
+		else if(trig->prev < level + hysteresis)
+			*low = 0, *high = level + hysteresis - 1;
+		else if(trig->prev > trig->high - hysteresis)
+			*low = trig->high - hysteresis + 1, *high = 4095;
+		break;
+
+	case ADC_TRIG_WIDER:
+	case ADC_TRIG_NARROWER:
+		if(trig->armed == ARMED_NO)
+			*low = clamp(level - hysteresis), *high = 4095;
+		else if(trig->armed == ARMED_BELOW)
+			*low = 0, *high = level - 1;
+		else if(trig->armed == PULSE_STARTED)
+			*low = clamp(level - hysteresis), *high = clamp(level + hysteresis);
+		else
+			*low = level + 1, *high = 4095;
+		break;
+	}
+}
+
+/*******************************************************************************
+ * Evaluate values in order, the state is kept between calls
+ *
+ * Return value: index of the value the trigger fired on or -1 if not found
+ ******************************************************************************/
+int adc_trig_search(struct adc_trig *trig, const uint16_t *values, int count)
+{
+	return adc_trig_search_stride(trig, values, count, 1);
+}
+
+/*******************************************************************************
+ * As adc_trig_search() for every stride value
+ *
+ * Return value: index, in values of stride, the trigger fired on or -1
+ ******************************************************************************/
+int adc_trig_search_stride(struct adc_trig *trig, const uint16_t *values,
+                           int count, int stride)
+{
+	for(int i = 0; i < count; i++)
+		if(adc_trig_step(trig, values[i * stride]))
+			return i;
+
+	return -1;
+}
+
+/*******************************************************************************
+ * Unpack values from DMA words and evaluate the trigger at the same time. All
+ * values are unpacked even when the trigger fires early.
+ *
+ * Four values are checked at a time against the quiet range of the current
+ * state. Values have bit 15 clear, so with bit 15 set in a lane subtracting
+ * low leaves bit 15 set only for values >= low and never borrows from the
+ * next lane, likewise for high. Only blocks with values outside the range are
+ * evaluated value by value.
+ *
+ * Return value: index of the value the trigger fired on or -1 if not found
+ ******************************************************************************/
+int adc_unpack_trig(struct adc_trig *trig, uint16_t *values,
+                    const uint32_t *words, int count)
+{
+	int pulse = trig->mode == ADC_TRIG_WIDER || trig->mode == ADC_TRIG_NARROWER;
+	int low, high;
+	int i;
+
+	adc_trig_quiet(trig, &low, &high);
+
+	for(i = 0; i + 4 <= count; i += 4)
+	{
+		uint32_t w0 = words[i / 2] & LANE_VALUES;
+		uint32_t w1 = words[i / 2 + 1] & LANE_VALUES;
+
+		values[i] = w0 >> 16;
+		values[i + 1] = w0 & 0xffff;
+		values[i + 2] = w1 >> 16;
+		values[i + 3] = w1 & 0xffff;
+
+		if(low <= high)
+		{
+			uint32_t lows = low * LANE_ONES;
+			uint32_t highs = (high * LANE_ONES) | LANE_SIGNS;
+
+			uint32_t quiet = ((w0 | LANE_SIGNS) - lows) &
+			                 ((w1 | LANE_SIGNS) - lows) &
+			                 (highs - w0) & (highs - w1) & LANE_SIGNS;
+
+			if(quiet == LANE_SIGNS)
+			{
+				trig->prev = values[i + 3];
+
+				if(pulse && trig->armed >= PULSE_STARTED)
+					trig->count += 4;
+
+				continue;
+			}
+		}
+
+		int found = adc_trig_search(trig, &values[i], 4);
+
+		if(found >= 0)
+		{
+			adc_unpack(&values[i + 4], &words[i / 2 + 2], count - i - 4);
+			return i + found;
+		}
+
+		adc_trig_quiet(trig, &low, &high);
+	}
+
+	adc_unpack(&values[i], &words[i / 2], count - i);
+
+	int found = adc_trig_search(trig, &values[i], count - i);
+
+	return found < 0 ? -1 : i + found;
+}
+
+/*******************************************************************************
+ * Clear statistics
+ ******************************************************************************/
+void adc_measure_reset(struct adc_measure *measure)
+{
+	*measure = (struct adc_measure){ .min = 0xffff };
+}
+
+/*******************************************************************************
+ * Add values to statistics, count must be above zero
+ ******************************************************************************/
+void adc_measure_block(struct adc_measure *m, const uint16_t *values, int count)
+{
+	if(!m->levels)
+	{
+		uint16_t min = values[0];
+		uint16_t max = values[0];
+
+		for(int i = 1; i < count; i++)
+		{
+			if(values[i] < min)
+				min = values[i];
+
+			if(values[i] > max)
+				max = values[i];
+		}
+
+		int range = max - min;
+
+		m->low = min + range / 10;
+		m->mid = min + range / 2;
+		m->high = min + range * 9 / 10;
+		m->hysteresis = range / 10;
+		m->above = values[0] >= m->mid;
+		m->levels = 1;
+	}
+
+	int mid_low = m->mid - m->hysteresis;
+	int mid_high = m->mid + m->hysteresis;
+
+	for(int i = 0; i < count; i++)
+	{
+		uint16_t v = values[i];
+		uint32_t index = m->count++;
+
+		if(v < m->min)
+			m->min = v;
+
+		if(v > m->max)
+			m->max = v;
+
+		m->sum += v;
+		m->sum_squares += (uint32_t)v * v;
+
+		/* Edges at mid once the hysteresis band has been passed */
+		if(m->above)
+		{
+			if(v > mid_high)
+				m->armed = 1;
+
+			if(m->armed && v < m->mid)
+			{
+				m->above = 0;
+				m->armed = 0;
+			}
+		}
+		else
+		{
+			if(v < mid_low)
+				m->armed = 1;
+
+			if(m->armed && v >= m->mid)
+			{
+				m->above = 1;
+				m->armed = 0;
+
+				if(m->edges == 0)
+					m->first_edge = index;
+
+				m->last_edge = index;
+				m->high_at_last_edge = m->high_count;
+				m->edges += 1;
+			}
+		}
+
+		if(m->edges && m->above)
+			m->high_count += 1;
+
+		/* Rise time from leaving low, at or below it, to reaching high */
+		if(v <= m->low)
+			m->rising = 1;
+		else if(m->rising == 1)
+		{
+			m->rising = 2;
+			m->rise_start = index;
+		}
+
+		if(m->rising == 2 && v >= m->high)
+		{
+			m->rise_sum += index - m->rise_start;
+			m->rises += 1;
+			m->rising = 0;
+		}
+	}
+}
+
+/*******************************************************************************
+ * Check filter configuration. CIC integrators wrap at 32 bits which is fine
+ * as long as the 12-bit input times the gain ratio^order fits.
+ *
+ * Return value: 1 if valid
+ ******************************************************************************/
+int adc_filter_valid(const struct adc_filter_config *config)
+{
+	uint64_t gain = 1;
+
+	switch(config->type)
+	{
+	case ADC_FILTER_NONE:
+		return 1;
+
+	case ADC_FILTER_AVERAGE:
+		return config->ratio >= 1;
+
+	case ADC_FILTER_BOXCAR:
+		return config->ratio >= 1 && config->ratio <= ADC_BOXCAR_MAX;
+
+	case ADC_FILTER_CIC:
+		if(config->ratio < 1 || config->order < 1 ||
+		   config->order > ADC_CIC_MAX_ORDER)
+			return 0;
+
+		for(int i = 0; i < config->order; i++)
+			gain *= config->ratio;
+
+		return gain <= (1 << 20);
+	}
+
+	return 0;
+}
+
+/*******************************************************************************
+ * Return value: number of input values per output value
+ ******************************************************************************/
+int adc_filter_decimation(const struct adc_filter_config *config)
+{
+	if(config->type == ADC_FILTER_AVERAGE || config->type == ADC_FILTER_CIC)
+		return config->ratio;
+
+	return 1;
+}
+
+void adc_filter_reset(struct adc_filter *filter,
+                      const struct adc_filter_config *config)
+{
+	*filter = (struct adc_filter){ .config = *config, .gain = 1 };
+
+	if(config->type == ADC_FILTER_CIC)
+		for(int i = 0; i < config->order; i++)
+			filter->gain *= config->ratio;
+}
+
+/*******************************************************************************
+ * Filter 12-bit values into values with ADC_FILTER_FRACTION fraction bits,
+ * rounded. out may be the same memory as in.
+ *
+ * Return value: number of values written to out
+ ******************************************************************************/
+int adc_filter_run(struct adc_filter *filter, uint16_t *out, const uint16_t *in,
+                   int count)
+{
+	struct adc_filter *f = filter;
+	uint32_t ratio = f->config.ratio;
+	int order = f->config.order;
+	int n = 0;
+
+	switch(f->config.type)
+	{
+	case ADC_FILTER_NONE:
+		for(int i = 0; i < count; i++)
+			out[n++] = in[i] << ADC_FILTER_FRACTION;
+		break;
+
+	case ADC_FILTER_AVERAGE:
+		for(int i = 0; i < count; i++)
+		{
+			f->sum += in[i];
+
+			if(++f->phase == ratio)
+			{
+				out[n++] = (((uint64_t)f->sum << ADC_FILTER_FRACTION) + ratio / 2) /
+				           ratio;
+				f->sum = 0;
+				f->phase = 0;
+			}
+		}
+		break;
+
+	case ADC_FILTER_BOXCAR:
+		for(int i = 0; i < count; i++)
+		{
+			/* Running sum, averaged over the values seen until full */
+			f->sum += in[i] - f->history[f->phase];
+			f->history[f->phase] = in[i];
+
+			if(++f->phase == ratio)
+				f->phase = 0;
+
+			if(f->filled < ratio)
+				f->filled += 1;
+
+			out[n++] = (((uint64_t)f->sum << ADC_FILTER_FRACTION) + f->filled / 2) /
+			           f->filled;
+		}
+		break;
+
+	case ADC_FILTER_CIC:
+		for(int i = 0; i < count; i++)
+		{
+			uint32_t y = in[i];
+
+			for(int k = 0; k < order; k++)
+				y = f->integrators[k] += y;
+
+			if(++f->phase < ratio)
+				continue;
+
+			f->phase = 0;
+
+			for(int k = 0; k < order; k++)
+			{
+				uint32_t previous = f->combs[k];
+
+				f->combs[k] = y;
+				y -= previous;
+			}
+
+			out[n++] = (((uint64_t)y << ADC_FILTER_FRACTION) + f->gain / 2) /
+			           f->gain;
+		}
+		break;
+	}
+
+	return n;
+}
+
+/*******************************************************************************
+ * Unpack two channels scanned alternately, each word holds one value of each
+ * in either order. The 4-bit channel number above the 12-bit value tells them
+ * apart, pairs are stored first channel first. values may be the same memory
+ * as words.
+ *
+ * If trig is not NULL it is evaluated on the values of channel index
+ * trig_channel, 0 or 1, while unpacking.
+ *
+ * Return value: index of the pair the trigger fired on or -1 if not found
+ ******************************************************************************/
+int adc_unpack_scan(struct adc_trig *trig, int trig_channel, uint16_t *values,
+                    const uint32_t *words, int count, uint8_t first_channel)
+{
+	int found = -1;
+
+	for(int i = 0; i < count / 2; i++)
+	{
+		uint32_t w = words[i];
+		uint16_t high = w >> 16;
+		uint16_t low = w & 0xffff;
+
+		if(high >> 12 == first_channel)
+		{
+			values[2 * i] = high & 0x0fff;
+			values[2 * i + 1] = low & 0x0fff;
+		}
+		else
+		{
+			values[2 * i] = low & 0x0fff;
+			values[2 * i + 1] = high & 0x0fff;
+		}
+
+		if(trig && found < 0 && adc_trig_step(trig, values[2 * i + trig_channel]))
+			found = i;
+	}
+
+	return found;
+}
+
+/*******************************************************************************
+ * Return value: log2 of points, or -1 if not a power of two in
+ * ADC_FFT_MIN-ADC_FFT_MAX
+ ******************************************************************************/
+int adc_fft_log2(int points)
+{
+	int log2n = 0;
+
+	if(points < ADC_FFT_MIN || points > ADC_FFT_MAX || (points & (points - 1)))
+		return -1;
+
+	while((1 << log2n) < points)
+		log2n++;
+
+	return log2n;
+}
+
+/*******************************************************************************
+ * Fill table with points window coefficients in Q15
+ *
+ * Return value: coherent gain, the mean of the coefficients
+ ******************************************************************************/
+float adc_window_build(int16_t *table, int points, enum adc_window window)
+{
+	float sum = 0;
+
+	for(int i = 0; i < points; i++)
+	{
+		float x = 2 * (float)M_PI * i / points;
+		float w = 1;
+
+		if(window == ADC_WINDOW_HANN)
+			w = 0.5f - 0.5f * cosf(x);
+		else if(window == ADC_WINDOW_BLACKMAN)
+			w = 0.42f - 0.5f * cosf(x) + 0.08f * cosf(2 * x);
+
+		table[i] = lrintf(w * 32767);
+		sum += table[i];
+	}
+
+	return sum / 32767 / points;
+}
+
+/* sin(2 pi i / ADC_FFT_MAX) in Q15 for a quarter turn */
+static int16_t fft_sine[ADC_FFT_MAX / 4 + 1];
+
+static void fft_init()
+{
+	if(fft_sine[ADC_FFT_MAX / 4])
+		return;
+
+	for(int i = 0; i <= ADC_FFT_MAX / 4; i++)
+		fft_sine[i] = lrintf(sinf(2 * (float)M_PI * i / ADC_FFT_MAX) * 32767);
+}
+
+/*******************************************************************************
+ * In place FFT of 2^log2n complex values, without scaling. Values grow by at
+ * most 2^log2n so inputs must stay below 2^(31 - log2n).
+ ******************************************************************************/
+void adc_fft(int32_t *data, int log2n)
+{
+	int points = 1 << log2n;
+
+	fft_init();
+
+	/* Bit reversed order */
+	for(int i = 1, j = 0; i < points; i++)
+	{
+		int bit = points >> 1;
+
+		for(; j & bit; bit >>= 1)
+			j ^= bit;
+
+		j |= bit;
+
+		if(i < j)
+		{
+			int32_t re = data[2 * i];
+			int32_t im = data[2 * i + 1];
+
+			data[2 * i] = data[2 * j];
+			data[2 * i + 1] = data[2 * j + 1];
+			data[2 * j] = re;
+			data[2 * j + 1] = im;
+		}
+	}
+
+	for(int len = 2; len <= points; len <<= 1)
+	{
+		int step = ADC_FFT_MAX / len; /* Twiddle index step */
+
+		for(int k = 0; k < len / 2; k++)
+		{
+			/* w = exp(-2 pi i k / len) */
+			int t = k * step;
+			int32_t cos = t <= ADC_FFT_MAX / 4 ?
+				fft_sine[ADC_FFT_MAX / 4 - t] : -fft_sine[t - ADC_FFT_MAX / 4];
+			int32_t sin = t <= ADC_FFT_MAX / 4 ?
+				fft_sine[t] : fft_sine[ADC_FFT_MAX / 2 - t];
+
+			for(int i = k; i < points; i += len)
+			{
+				int32_t *a = &data[2 * i];
+				int32_t *b = &data[2 * (i + len / 2)];
+				int64_t round = 1 << 14;
+				int32_t re = ((int64_t)b[0] * cos + (int64_t)b[1] * sin + round) >> 15;
+				int32_t im = ((int64_t)b[1] * cos - (int64_t)b[0] * sin + round) >> 15;
+
+				b[0] = a[0] - re;
+				b[1] = a[1] - im;
+				a[0] += re;
+				a[1] += im;
+			}
+		}
+	}
+}
+
+/*******************************************************************************
+ * Add the power spectrum of a frame to power, points / 2 + 1 bins. data holds
+ * the raw 12-bit values of the frame in the re parts on entry and is used for
+ * the transform. The mean is removed before the window.
+ ******************************************************************************/
+void adc_spectrum_frame(float *power, int32_t *data, const int16_t *window,
+                        int log2n)
+{
+	int points = 1 << log2n;
+	int32_t sum = 0;
+
+	for(int i = 0; i < points; i++)
+		sum += data[2 * i];
+
+	/* Scaled by 16 and centered below 2^16, 4096 points grow to below 2^28 */
+	int32_t mean = (sum << 4) / points;
+
+	for(int i = 0; i < points; i++)
+	{
+		data[2 * i] = ((data[2 * i] << 4) - mean) * window[i] >> 15;
+		data[2 * i + 1] = 0;
+	}
+
+	adc_fft(data, log2n);
+
+	for(int i = 0; i <= points / 2; i++)
+	{
+		float re = data[2 * i];
+		float im = data[2 * i + 1];
+
+		power[i] += re * re + im * im;
+	}
+}
+
+/*******************************************************************************
+ * Find the largest local maxima of power, DC excluded, largest first
+ *
+ * Return value: number of bin indexes in peaks, at most max
+ ******************************************************************************/
+int adc_spectrum_peaks(const float *power, int bins, int *peaks, int max)
+{
+	int count = 0;
+
+	for(int i = 1; i < bins; i++)
+	{
+		if(power[i] <= power[i - 1] || (i + 1 < bins && power[i] < power[i + 1]))
+			continue;
+
+		/* Insertion sort */
+		int j = count < max ? count++ : max;
+
+		for(; j > 0 && power[peaks[j - 1]] < power[i]; j--)
+			if(j < max)
+				peaks[j] = peaks[j - 1];
+
+		if(j < max)
+			peaks[j] = i;
+	}
+
+	return count;
+}
+
+/*******************************************************************************
+ * Envelope of a new capture with bucket values per min, max pair
+ ******************************************************************************/
+void adc_envelope_reset(struct adc_envelope *envelope, uint16_t bucket)
+{
+	envelope->bucket = bucket;
+	envelope->fill = 0;
+	envelope->min = 0xffff;
+	envelope->max = 0;
+}
+
+/*******************************************************************************
+ * Add every stride value, a min, max pair is written to pairs for each full
+ * bucket. pairs needs room for (fill + count) / bucket pairs.
+ *
+ * Return value: number of pairs written
+ ******************************************************************************/
+int adc_envelope_run(struct adc_envelope *envelope, uint16_t *pairs,
+                     const uint16_t *values, int count, int stride)
+{
+	uint16_t min = envelope->min;
+	uint16_t max = envelope->max;
+	int fill = envelope->fill;
+	int n = 0;
+
+	for(int i = 0; i < count; i++, values += stride)
+	{
+		uint16_t v = *values;
+
+		if(v < min)
+			min = v;
+
+		if(v > max)
+			max = v;
+
+		if(++fill < envelope->bucket)
+			continue;
+
+		pairs[n++] = min;
+		pairs[n++] = max;
+		min = 0xffff;
+		max = 0;
+		fill = 0;
+	}
+
+	envelope->min = min;
+	envelope->max = max;
+	envelope->fill = fill;
+
+	return n / 2;
+}
+
+/*******************************************************************************
+ * End the capture, a last partial bucket is written to pairs
+ *
+ * Return value: number of pairs written, 0 or 1
+ ******************************************************************************/
+int adc_envelope_finish(struct adc_envelope *envelope, uint16_t *pairs)
+{
+	if(envelope->fill == 0)
+		return 0;
+
+	pairs[0] = envelope->min;
+	pairs[1] = envelope->max;
+
+	adc_envelope_reset(envelope, envelope->bucket);
+
+	return 1;
+}
@@ -0,0 +1,161 @@
+#pragma once
+/*
+ * Sample kernels for the I2S ADC path. They do not depend on ESP-IDF so they
+ * can also be built and checked on a host.
+ *
+ * The I2S DMA buffer holds two 16-bit samples per 32-bit word, the first
+ * sample in the high half, with the 12-bit value in the low bits. count is
+ * the number of samples and must be even. values may be the same memory as
+ * words to unpack in place.
+ */
+
+#include <stdint.h>
+
+enum adc_trig_mode
+{
+	ADC_TRIG_ANY = 0, /* Equal to level or crossing level */
+	ADC_TRIG_RISING, /* Up to level after being below level - hysteresis */
+	ADC_TRIG_FALLING, /* Down to level after being above level + hysteresis */
+	ADC_TRIG_EITHER, /* Rising or falling */
+	ADC_TRIG_ENTER, /* Into [level, high] after being outside by hysteresis */
+	ADC_TRIG_LEAVE, /* Out of [level, high] after being inside by hysteresis */
+	ADC_TRIG_WIDER, /* End of a high pulse wider than width samples */
+	ADC_TRIG_NARROWER /* End of a high pulse narrower than width samples */
+};
+
+struct adc_trig
+{
+	/* Configuration */
+	uint8_t mode;
+	uint16_t level;
+	uint16_t high;
+	uint16_t hysteresis;
+	uint32_t width;
+
+	/* State, see adc_trig_reset() */
+	uint16_t prev;
+	uint8_t armed;
+	uint32_t count;
+};
+
+/*
+ * Statistics of a capture, accumulated one block of values at a time. The
+ * 10 %, 50 % and 90 % levels used for edges and rise time are taken from the
+ * range of the first block.
+ */
+struct adc_measure
+{
+	uint32_t count;
+	uint16_t min;
+	uint16_t max;
+	uint64_t sum;
+	uint64_t sum_squares;
+
+	/* Levels */
+	uint8_t levels; /* Set */
+	uint16_t low;
+	uint16_t mid;
+	uint16_t high;
+	uint16_t hysteresis; /* Around mid */
+
+	/* Edges at mid */
+	uint8_t above;
+	uint8_t armed;
+	uint32_t edges; /* Rising */
+	uint32_t first_edge;
+	uint32_t last_edge;
+	uint32_t high_count; /* Values above mid since the first edge */
+	uint32_t high_at_last_edge;
+
+	/* Rise time from low to high */
+	uint8_t rising;
+	uint32_t rise_start;
+	uint32_t rises;
+	uint64_t rise_sum;
+};
+
+enum adc_filter_type
+{
+	ADC_FILTER_NONE = 0,
+	ADC_FILTER_AVERAGE, /* Mean of every ratio values, decimates by ratio */
+	ADC_FILTER_BOXCAR, /* Mean of the last ratio values, no decimation */
+	ADC_FILTER_CIC /* order stage CIC, decimates by ratio */
+};
+
+/* Filter output has this many fraction bits */
+#define ADC_FILTER_FRACTION 4
+#define ADC_BOXCAR_MAX 256
+#define ADC_CIC_MAX_ORDER 4
+
+struct adc_filter_config
+{
+	uint8_t type;
+	uint8_t order;
+	uint16_t ratio;
+};
+
+struct adc_filter
+{
+	struct adc_filter_config config;
+
+	/* State, see adc_filter_reset() */
+	uint32_t sum;
+	uint16_t phase;
+	uint16_t filled;
+	uint32_t gain;
+	uint32_t integrators[ADC_CIC_MAX_ORDER];
+	uint32_t combs[ADC_CIC_MAX_ORDER];
+	uint16_t history[ADC_BOXCAR_MAX];
+};
+
+/*
+ * Spectrum of frames of values, a radix-2 FFT on complex int32 values as
+ * re, im pairs. A frame is windowed with a Q15 table, the power of each bin
+ * 0 to points / 2 is accumulated as float.
+ */
+enum adc_window
+{
+	ADC_WINDOW_RECT = 0,
+	ADC_WINDOW_HANN,
+	ADC_WINDOW_BLACKMAN
+};
+
+#define ADC_FFT_MIN 256
+#define ADC_FFT_MAX 4096
+
+/* Min and max of every bucket values, kept between calls */
+struct adc_envelope
+{
+	uint16_t bucket;
+	uint16_t fill; /* Values in current bucket */
+	uint16_t min;
+	uint16_t max;
+};
+
+void adc_unpack(uint16_t *values, const uint32_t *words, int count);
+void adc_trig_reset(struct adc_trig *trig, uint16_t prev);
+int adc_trig_search(struct adc_trig *trig, const uint16_t *values, int count);
+int adc_trig_search_stride(struct adc_trig *trig, const uint16_t *values,
+                           int count, int stride);
+int adc_unpack_trig(struct adc_trig *trig, uint16_t *values,
+                    const uint32_t *words, int count);
+void adc_measure_reset(struct adc_measure *measure);
+void adc_measure_block(struct adc_measure *m, const uint16_t *values, int count);
+int adc_filter_valid(const struct adc_filter_config *config);
+int adc_filter_decimation(const struct adc_filter_config *config);
+void adc_filter_reset(struct adc_filter *filter,
+                      const struct adc_filter_config *config);
+int adc_filter_run(struct adc_filter *filter, uint16_t *out, const uint16_t *in,
+                   int count);
+int adc_unpack_scan(struct adc_trig *trig, int trig_channel, uint16_t *values,
+                    const uint32_t *words, int count, uint8_t first_channel);
+int adc_fft_log2(int points);
+float adc_window_build(int16_t *table, int points, enum adc_window window);
+void adc_fft(int32_t *data, int log2n);
+void adc_spectrum_frame(float *power, int32_t *data, const int16_t *window,
+                        int log2n);
+int adc_spectrum_peaks(const float *power, int bins, int *peaks, int max);
+void adc_envelope_reset(struct adc_envelope *envelope, uint16_t bucket);
+int adc_envelope_run(struct adc_envelope *envelope, uint16_t *pairs,
+                     const uint16_t *values, int count, int stride);
+int adc_envelope_finish(struct adc_envelope *envelope, uint16_t *pairs);
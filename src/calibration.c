@@ -23,6 +23,8 @@
 #include <string.h>
 
 #include "errors.h"
+#include "calibration.h"
+#include "adc.h"
 #include "hci.h"
 
 enum
@@ -164,93 +166,68 @@ open_err:
 /*******************************************************************************
  *
  ******************************************************************************/
-void calibration_command()
+static void calibration_cmd_list(int param, const union command_value *args,
+                                 int count)
 {
-	char *cmd = strtok(NULL, " ");
+	printf("OK %d\n", PARAMETER_COUNT);
 
-	/* Make sure we have a command */
-	if(!cmd)
-		goto einval;
-
-	/*
-	 * Compare commande against known commands and handle them, otherwise tell
-	 * the user it was invalid.
-	 */
-	if(strcmp(cmd, "help") == 0)
-	{
-		printf("OK\n");
-		printf(
-			"Available commands:\n"
-			"\n"
-			"calibration list - print out all calibration parameters\n"
-			"calibration write <parameter> <value> - write value to parameter (u32)\n"
-			"calibration read <parameter> - print out current parameter value (u32)\n");
-	}
-	else if(strcmp(cmd, "list") == 0)
-	{
-		printf("OK %d\n", PARAMETER_COUNT);
-
-		for(int i = 0; i < PARAMETER_COUNT; i++)
-		{
-			const char *parameter = parameter_names[i];
-			uint32_t value;
-
-			if(read_parameter_value(parameter, &value) < 0)
-				printf("%s\t<not set>\n", parameter);
-			else
-				printf("%s\t%u\n", parameter, value);
-		}
-	}
-	else if(strcmp(cmd, "write") == 0)
+	for(int i = 0; i < PARAMETER_COUNT; i++)
 	{
-		char *parameter;
-		char *value_str;
+		const char *parameter = parameter_names[i];
 		uint32_t value;
 
-		/* Read parameter argument */
-		parameter = strtok(NULL, " ");
-		if(!parameter)
-			goto einval;
-
-		/* Read value argument */
-		value_str = strtok(NULL, " ");
-
-		if(value_str)
-			value = strtoul(value_str, NULL, 10);
+		if(read_parameter_value(parameter, &value) < 0)
+			printf("%s\t<not set>\n", parameter);
 		else
-			goto einval;
-
-		/* Send command */
-		if(write_parameter_value(parameter, value) < 0)
-			return;
-
-		printf("OK\n");
+			printf("%s\t%u\n", parameter, value);
 	}
-	else if(strcmp(cmd, "read") == 0)
-	{
-		char *parameter;
+}
 
-		/* Read period argument */
-		parameter = strtok(NULL, " ");
-		if(!parameter)
-			goto einval;
+/*******************************************************************************
+ *
+ ******************************************************************************/
+static void calibration_cmd_write(int param, const union command_value *args,
+                                  int count)
+{
+	/* Send command */
+	if(write_parameter_value(args[0].s, args[1].u) < 0)
+		return;
 
-		/* Read parameter value */
-		uint32_t value;
-		if(read_parameter_value(parameter, &value) < 0)
-		{
-			printf("ERR Could not read parameter\n");
-			return;
-		}
+	/* ADC conversion tables are built from the calibration */
+	adc_calibration_changed();
 
-		printf("OK %d\n", value);
-	}
-	else
-		goto einval;
+	printf("OK\n");
+}
 
-	return;
+/*******************************************************************************
+ *
+ ******************************************************************************/
+static void calibration_cmd_read(int param, const union command_value *args,
+                                 int count)
+{
+	/* Read parameter value */
+	uint32_t value;
+	if(read_parameter_value(args[0].s, &value) < 0)
+	{
+		printf("ERR Could not read parameter\n");
+		return;
+	}
 
-einval:
-	printf(EINVAL);
-	return;
+	printf("OK %d\n", value);
 }
+
+/* Must be sorted by name */
+static const struct command calibration_commands[] =
+{
+	{ "list", "print out all calibration parameters", calibration_cmd_list },
+	{ "read", "print out current parameter value (u32)", calibration_cmd_read,
+		{ { "parameter", ARG_WORD } } },
+	{ "write", "write value to parameter (u32)", calibration_cmd_write,
+		{ { "parameter", ARG_WORD },
+		  { "value", ARG_U32 } } },
+};
+
+const struct command_table calibration_command_table =
+{
+	NULL, calibration_commands, COMMAND_COUNT(calibration_commands)
+};
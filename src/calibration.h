@@ -1,3 +1,5 @@
 #pragma once
 
-void calibration_command();
+#include "command.h"
+
+extern const struct command_table calibration_command_table;
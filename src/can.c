@@ -30,6 +30,8 @@
 #include "errors.h"
 #include "can.h"
 #include "hci.h"
+#include "fmt.h"
+#include "timebase.h"
 
 const int can_tx_pin = GPIO_NUM_0;
 const int can_rx_pin = GPIO_NUM_2;
@@ -68,6 +70,7 @@ static EventGroupHandle_t can_event_group;
 struct can_rx_event
 {
 	uint8_t event;
+	int32_t tag;
 };
 
 enum
@@ -173,177 +176,165 @@ int parse_message_format(can_message_t *msg, const char *fmt)
 	return 0;
 }
 
-void can_command()
+static void can_cmd_rx(int param, const union command_value *args, int count)
 {
-	char *cmd = strtok(NULL, " ");
-	esp_err_t err;
+	if(args[0].i)
+		can_rx_on();
+	else
+		can_rx_off();
+}
 
-	/* Make sure we have a command */
-	if(!cmd)
-		goto einval;
+static void can_cmd_send(int param, const union command_value *args, int count)
+{
+	can_message_t msg;
+	esp_err_t err;
 
-	/*
-	 * Compare commande against known commands and handle them, otherwise tell
-	 * the user it was invalid.
-	 */
-	if(strcmp(cmd, "help") == 0)
-	{
-		printf("OK\n");
-		printf(
-			"Available commands:\n"
-			"Source clock: 80 MHz\n"
-			"CAN bitrate = 80 000 000 / brp / (1 + tseg_1 + tseg_2)\n"
-			"\n"
-			"can help - write this text\n"
-			"can rx on/off - enable or disable RX\n"
-			"can send <id>#<data in hex> - e.g. send 13f#02e8\n"
-			"can config brp [value] - get or set current can brp (2-128, even)\n"
-			"can config tseg_1 [value] - get or set current can tseg_1 (1-16)\n"
-			"can config tseg_2 [value] - get or set current can tseg_2 (1-8)\n"
-			"can config sjw [value] - get or set current can sjw (1-4)\n"
-			"\n");
-	}
-	else if(strcmp(cmd, "rx") == 0)
+	memset(&msg, 0, sizeof(msg));
+	if(parse_message_format(&msg, args[0].s) < 0)
 	{
-		const char *arg = strtok(NULL, " ");
-
-		if(strcmp(arg, "on") == 0)
-			can_rx_on();
-		else if(strcmp(arg, "off") == 0)
-			can_rx_off();
-		else
-			goto einval;
+		printf(EINVAL);
+		return;
 	}
-	else if(strcmp(cmd, "send") == 0)
-	{
-		can_message_t msg;
-		const char *msg_str = strtok(NULL, " ");
-
-		memset(&msg, 0, sizeof(msg));
-		if(parse_message_format(&msg, msg_str) < 0)
-			goto einval;
-
-		err = can_transmit(&msg, 0);
-		if(err != ESP_OK)
-		{
-			printf("ERR Transmit failed!\n");
 
-			/*
-			 * If we get to many transmission errors due to non-acked frames
-			 * then the bus will go into an error state, restart it by
-			 * reinstalling it.
-			 */
-			can_send_reinstall();
-
-			return;
-		}
-
-		printf("OK\n");
-	}
-	else if(strcmp(cmd, "config") == 0)
+	err = can_transmit(&msg, 0);
+	if(err != ESP_OK)
 	{
-		/* Read value argument */
-		const char *arg = strtok(NULL, " ");
-		if(!arg)
-			goto einval;
+		printf("ERR Transmit failed!\n");
 
-		if(strcmp(arg, "brp") == 0)
-		{
-			const char *value_str = strtok(NULL, " ");
+		/*
+		 * If we get to many transmission errors due to non-acked frames
+		 * then the bus will go into an error state, restart it by
+		 * reinstalling it.
+		 */
+		can_send_reinstall();
 
-			if(!value_str)
-				printf("OK %d\n", can_config.timing.brp);
+		return;
+	}
 
-			else
-			{
-				int value = atoi(value_str);
+	printf("OK\n");
+}
 
-				if(value < 2 || value > 127 || value % 2)
-					goto einval;
+static void can_cmd_config_brp(int param, const union command_value *args, int count)
+{
+	if(count == 0)
+	{
+		printf("OK %d\n", can_config.timing.brp);
+		return;
+	}
 
-				can_config.timing.brp = value;
+	if(args[0].i % 2)
+	{
+		printf(EINVAL);
+		return;
+	}
 
-				can_send_reinstall();
-			}
-		}
-		else if(strcmp(arg, "tseg_1") == 0)
-		{
-			const char *value_str = strtok(NULL, " ");
+	can_config.timing.brp = args[0].i;
 
-			if(!value_str)
-				printf("OK %d\n", can_config.timing.tseg_1);
+	can_send_reinstall();
+}
 
-			else
-			{
-				int value = atoi(value_str);
+static void can_cmd_config_tseg_1(int param, const union command_value *args, int count)
+{
+	if(count == 0)
+	{
+		printf("OK %d\n", can_config.timing.tseg_1);
+		return;
+	}
 
-				if(value < 1 || value > 16 )
-					goto einval;
+	can_config.timing.tseg_1 = args[0].i;
 
-				can_config.timing.tseg_1 = value;
+	can_send_reinstall();
+}
 
-				can_send_reinstall();
-			}
-		}
-		else if(strcmp(arg, "tseg_2") == 0)
-		{
-			const char *value_str = strtok(NULL, " ");
+static void can_cmd_config_tseg_2(int param, const union command_value *args, int count)
+{
+	if(count == 0)
+	{
+		printf("OK %d\n", can_config.timing.tseg_2);
+		return;
+	}
 
-			if(!value_str)
-				printf("OK %d\n", can_config.timing.tseg_2);
+	can_config.timing.tseg_2 = args[0].i;
 
-			else
-			{
-				int value = atoi(value_str);
+	can_send_reinstall();
+}
 
-				if(value < 1 || value > 8 )
-					goto einval;
+static void can_cmd_config_sjw(int param, const union command_value *args, int count)
+{
+	if(count == 0)
+	{
+		printf("OK %d\n", can_config.timing.sjw);
+		return;
+	}
 
-				can_config.timing.tseg_2 = value;
+	can_config.timing.sjw = args[0].i;
 
-				can_send_reinstall();
-			}
-		}
-		else if(strcmp(arg, "sjw") == 0)
-		{
-			const char *value_str = strtok(NULL, " ");
+	can_send_reinstall();
+}
 
-			if(!value_str)
-				printf("OK %d\n", can_config.timing.sjw);
+static void can_cmd_status(int param, const union command_value *args, int count)
+{
+}
 
-			else
-			{
-				int value = atoi(value_str);
+/*
+ * "@<time> CAN RX: 1ff#0011223344556677\n", returns the length. buf must fit
+ * CAN_RX_TEXT_MAX bytes.
+ */
+#define CAN_RX_TEXT_MAX 64
+static int can_format_rx(char *buf, uint64_t time, const can_message_t *msg)
+{
+	char *p = fmt_timestamp(buf, time);
 
-				if(value < 1 || value > 4 )
-					goto einval;
+	p = fmt_str(p, "CAN RX: ");
 
-				can_config.timing.sjw = value;
+	p = fmt_hex32(p, msg->identifier);
+	*p++ = '#';
 
-				can_send_reinstall();
-			}
-		}
-		else
-			goto einval;
-	}
-	else if(strcmp(cmd, "status") == 0)
-	{
-	}
+	if(msg->flags & CAN_MSG_FLAG_RTR)
+		*p++ = 'R';
 	else
-		goto einval;
+		p = fmt_hex(p, msg->data, msg->data_length_code <= 8 ? msg->data_length_code : 8);
 
-	return;
+	*p++ = '\n';
 
-einval:
-	printf(EINVAL);
-	return;
+	return p - buf;
 }
 
+/* Must be sorted by name */
+static const struct command can_commands[] =
+{
+	{ "config brp", "get or set current can brp (2-128, even)",
+		can_cmd_config_brp,
+		{ { "value", ARG_INT, ARG_OPTIONAL, 2, 127 } } },
+	{ "config sjw", "get or set current can sjw (1-4)",
+		can_cmd_config_sjw,
+		{ { "value", ARG_INT, ARG_OPTIONAL, 1, 4 } } },
+	{ "config tseg_1", "get or set current can tseg_1 (1-16)",
+		can_cmd_config_tseg_1,
+		{ { "value", ARG_INT, ARG_OPTIONAL, 1, 16 } } },
+	{ "config tseg_2", "get or set current can tseg_2 (1-8)",
+		can_cmd_config_tseg_2,
+		{ { "value", ARG_INT, ARG_OPTIONAL, 1, 8 } } },
+	{ "rx", "enable or disable RX", can_cmd_rx,
+		{ { "on/off", ARG_ONOFF } } },
+	{ "send", "send frame with data in hex, e.g. send 13f#02e8", can_cmd_send,
+		{ { "id#data", ARG_WORD } } },
+	{ "status", NULL, can_cmd_status },
+};
+
+const struct command_table can_command_table =
+{
+	"Source clock: 80 MHz\n"
+	"CAN bitrate = 80 000 000 / brp / (1 + tseg_1 + tseg_2)\n",
+	can_commands, COMMAND_COUNT(can_commands)
+};
+
 void can_rx_off()
 {
 	struct can_rx_event event =
 	{
-		.event = EVENT_CAN_RX_OFF
+		.event = EVENT_CAN_RX_OFF,
+		.tag = hci_get_tag()
 	};
 
 	xQueueSendToBack(can_rx_queue, &event, 0);
@@ -353,7 +344,8 @@ void can_rx_on()
 {
 	struct can_rx_event event =
 	{
-		.event = EVENT_CAN_RX_ON
+		.event = EVENT_CAN_RX_ON,
+		.tag = hci_get_tag()
 	};
 
 	xQueueSendToBack(can_rx_queue, &event, 0);
@@ -363,7 +355,8 @@ void can_send_reinstall()
 {
 	struct can_rx_event event =
 	{
-		.event = EVENT_CAN_REINSTALL
+		.event = EVENT_CAN_REINSTALL,
+		.tag = hci_get_tag()
 	};
 
 	xQueueSendToBack(can_rx_queue, &event, 0);
@@ -372,6 +365,29 @@ void can_send_reinstall()
 	xEventGroupWaitBits(can_event_group, can_reinstall_done, 1, 1, 1000 * portTICK_PERIOD_MS);
 }
 
+static void can_send_record(uint64_t time, const can_message_t *msg)
+{
+	/* <time (u64 le)> <id (u32 le)> <flags> <dlc> <data>... */
+	uint8_t buf[8 + 6 + 8];
+	int len = 0;
+
+	for(int i = 0; i < 8; i++)
+		buf[len++] = (time >> (8 * i)) & 0xff;
+
+	buf[len++] = msg->identifier & 0xff;
+	buf[len++] = (msg->identifier >> 8) & 0xff;
+	buf[len++] = (msg->identifier >> 16) & 0xff;
+	buf[len++] = (msg->identifier >> 24) & 0xff;
+	buf[len++] = (msg->flags & CAN_MSG_FLAG_RTR) ? 1 : 0;
+	buf[len++] = msg->data_length_code;
+
+	if(!(msg->flags & CAN_MSG_FLAG_RTR))
+		for(int i = 0; i < msg->data_length_code && i < 8; i++)
+			buf[len++] = msg->data[i];
+
+	hci_send_record(HCI_RECORD_CAN_RX, buf, len);
+}
+
 void can_rx_thread(void *parameters)
 {
 	/* Check that CAN initialized correctly */
@@ -383,38 +399,63 @@ void can_rx_thread(void *parameters)
 	can_rx_queue = xQueueCreate(10, sizeof(struct can_rx_event));
 
 	int rx_running = 0;
+	int tx_slot = -1;
 
 	while(1)
 	{
 		can_message_t msg;
 		while(can_receive(&msg, 10) == ESP_OK)
 		{
-			if(rx_running)
-			{
-				printf("CAN RX: %x#", msg.identifier);
-				if(msg.flags & CAN_MSG_FLAG_RTR)
-					printf("R");
-				else
-					for(int i = 0; i < msg.data_length_code; i++)
-						printf("%02x", msg.data[i]);
+			/* The thread blocks in can_receive so this is the RX time */
+			uint64_t time = timebase_now();
+
+			if(!rx_running)
+				continue;
 
-				printf("\n");
+			/* Record size estimate, ASCII: "@<time> CAN RX: 1ff#" + data + "\n" */
+			int size = hci_binary_mode() ? 24 + msg.data_length_code :
+			                               36 + 2 * msg.data_length_code;
+
+			if(hci_tx_slot_take(tx_slot, size) < 0)
+				continue;
+
+			if(hci_binary_mode())
+			{
+				can_send_record(time, &msg);
+			}
+			else
+			{
+				char buf[CAN_RX_TEXT_MAX];
+				hci_print_bytes((uint8_t*)buf, can_format_rx(buf, time, &msg));
 			}
 		}
 
 		struct can_rx_event event;
 		if(xQueueReceive(can_rx_queue, &event, 0))
 		{
+			hci_set_tag(event.tag);
+
 			if(event.event == EVENT_CAN_RX_OFF)
 			{
+				hci_free_tx_slot(tx_slot);
+				tx_slot = -1;
 				rx_running = 0;
 				printf("OK\n");
 			}
 
 			else if(event.event == EVENT_CAN_RX_ON)
 			{
-				rx_running = 1;
-				printf("OK\n");
+				/* About 2000 frames/s */
+				if(tx_slot < 0)
+					tx_slot = hci_alloc_tx_slot(1, 80, HCI_TX_PRIO_NORMAL, "can");
+
+				if(tx_slot < 0)
+					printf(ENOTIME);
+				else
+				{
+					rx_running = 1;
+					printf("OK\n");
+				}
 			}
 
 			else if(event.event == EVENT_CAN_REINSTALL)
@@ -438,6 +479,8 @@ void can_rx_thread(void *parameters)
 
 				xEventGroupSetBits(can_event_group, can_reinstall_done);
 			}
+
+			hci_set_tag(HCI_NO_TAG);
 		}
 	}
 }
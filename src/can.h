@@ -1,8 +1,11 @@
 #pragma once
 
+#include "command.h"
+
 int can_init();
-void can_command();
 void can_rx_off();
 void can_rx_on();
 void can_send_reinstall();
 void can_rx_thread(void *parameters);
+
+extern const struct command_table can_command_table;
@@ -0,0 +1,488 @@
+/*
+ *  This file is part of SWT21 lab kit firmware.
+ *
+ *  SWT21 lab kit firmware is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  SWT21 lab kit firmware is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with SWT21 lab kit firmware.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ *  Copyright 2021 Joachim Lublin, Binäs Teknik AB
+ */
+
+#include <freertos/FreeRTOS.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "command.h"
+#include "errors.h"
+#include "hci.h"
+#include "adc.h"
+#include "dac.h"
+#include "calibration.h"
+#include "can.h"
+#include "led.h"
+#include "lin.h"
+#include "uart.h"
+
+/* Maximum number of words in a command name */
+#define COMMAND_MAX_DEPTH 2
+#define COMMAND_MAX_WORDS (1 + COMMAND_MAX_DEPTH + COMMAND_MAX_ARGS)
+
+/* Must be sorted by name */
+static const struct
+{
+	const char *name;
+	int param;
+	const struct command_table *table;
+} modules[] =
+{
+	{ "adc0",        ADC0, &adc_command_table },
+	{ "adc1",        ADC1, &adc_command_table },
+	{ "calibration", 0,    &calibration_command_table },
+	{ "can",         0,    &can_command_table },
+	{ "dac0",        DAC0, &dac_command_table },
+	{ "dac1",        DAC1, &dac_command_table },
+	{ "hci",         0,    &hci_command_table },
+	{ "led",         0,    &led_command_table },
+	{ "lin",         0,    &lin_command_table },
+	{ "uart",        0,    &uart_command_table },
+};
+
+static const int module_count = COMMAND_COUNT(modules);
+
+/*******************************************************************************
+ * Compare name against count words joined by single spaces
+ *
+ * Return value: <0, 0 or >0 like strcmp(name, joined words)
+ ******************************************************************************/
+static int compare_words(const char *name, char *const *words, int count)
+{
+	for(int i = 0; i < count; i++)
+	{
+		if(i > 0)
+		{
+			if(*name != ' ')
+				return (unsigned char)*name - ' ';
+
+			name++;
+		}
+
+		for(const char *w = words[i]; *w; w++, name++)
+			if(*name != *w)
+				return (unsigned char)*name - (unsigned char)*w;
+	}
+
+	return (unsigned char)*name;
+}
+
+/*******************************************************************************
+ *
+ ******************************************************************************/
+static int find_module(const char *name)
+{
+	int lo = 0;
+	int hi = module_count - 1;
+
+	while(lo <= hi)
+	{
+		int mid = (lo + hi) / 2;
+		int cmp = strcmp(modules[mid].name, name);
+
+		if(cmp == 0)
+			return mid;
+
+		if(cmp < 0)
+			lo = mid + 1;
+		else
+			hi = mid - 1;
+	}
+
+	return -1;
+}
+
+/*******************************************************************************
+ * Find the command with the longest name matching the first words
+ *
+ * Return value: command or NULL, *depth is set to number of words used
+ ******************************************************************************/
+static const struct command *find_command(const struct command_table *table,
+                                          char *const *words, int count,
+                                          int *depth)
+{
+	if(count > COMMAND_MAX_DEPTH)
+		count = COMMAND_MAX_DEPTH;
+
+	for(int k = count; k > 0; k--)
+	{
+		int lo = 0;
+		int hi = table->count - 1;
+
+		while(lo <= hi)
+		{
+			int mid = (lo + hi) / 2;
+			int cmp = compare_words(table->commands[mid].name, words, k);
+
+			if(cmp == 0)
+			{
+				*depth = k;
+				return &table->commands[mid];
+			}
+
+			if(cmp < 0)
+				lo = mid + 1;
+			else
+				hi = mid - 1;
+		}
+	}
+
+	return NULL;
+}
+
+/*******************************************************************************
+ *
+ ******************************************************************************/
+static int parse_arg(const struct command_arg *arg, const char *str,
+                     union command_value *value)
+{
+	char *end;
+
+	if(arg->type == ARG_INT)
+	{
+		if((arg->flags & ARG_OR_OFF) && strcmp(str, "off") == 0)
+		{
+			value->i = ARG_OFF;
+			return 0;
+		}
+
+		long v = strtol(str, &end, 10);
+
+		if(*end || end == str || v < arg->min || v > arg->max)
+			return -1;
+
+		value->i = v;
+	}
+	else if(arg->type == ARG_U32)
+	{
+		if(*str == '-')
+			return -1;
+
+		value->u = strtoul(str, &end, 10);
+
+		if(*end || end == str)
+			return -1;
+	}
+	else if(arg->type == ARG_FLOAT)
+	{
+		value->f = strtof(str, &end);
+
+		if(*end || end == str)
+			return -1;
+	}
+	else if(arg->type == ARG_WORD)
+	{
+		value->s = str;
+	}
+	else if(arg->type == ARG_ONOFF)
+	{
+		if(strcmp(str, "on") == 0)
+			value->i = 1;
+
+		else if(strcmp(str, "off") == 0)
+			value->i = 0;
+
+		else
+			return -1;
+	}
+	else if(arg->type == ARG_CHOICE)
+	{
+		const char *choice = arg->choices;
+		int len = strlen(str);
+
+		for(int i = 0; *choice; i++)
+		{
+			const char *next = strchr(choice, '|');
+			int choice_len = next ? next - choice : strlen(choice);
+
+			if(choice_len == len && strncmp(choice, str, len) == 0)
+			{
+				value->i = i;
+				return 0;
+			}
+
+			if(!next)
+				break;
+
+			choice = next + 1;
+		}
+
+		return -1;
+	}
+	else
+		return -1;
+
+	return 0;
+}
+
+/*******************************************************************************
+ *
+ ******************************************************************************/
+static void print_usage(const char *module, const struct command *command)
+{
+	char buf[256];
+	int n = snprintf(buf, sizeof(buf), "%s %s", module, command->name);
+
+	for(int i = 0; i < COMMAND_MAX_ARGS && command->args[i].name; i++)
+	{
+		const struct command_arg *arg = &command->args[i];
+
+		if(arg->flags & ARG_OPTIONAL)
+			n += snprintf(buf + n, sizeof(buf) - n, " [%s]", arg->name);
+		else
+			n += snprintf(buf + n, sizeof(buf) - n, " <%s>", arg->name);
+
+		if(n >= sizeof(buf))
+			break;
+	}
+
+	printf("%s - %s\n", buf, command->description);
+}
+
+/*******************************************************************************
+ *
+ ******************************************************************************/
+static void print_help()
+{
+	printf("OK\n");
+	printf(
+		"Available commands:\n"
+		"\n"
+		"help - write this text\n");
+
+	for(int i = 0; i < module_count; i++)
+		printf("%s help - write all %s commands\n",
+		       modules[i].name, modules[i].name);
+
+	printf("\n");
+}
+
+/*******************************************************************************
+ *
+ ******************************************************************************/
+static void print_module_help(int module)
+{
+	const struct command_table *table = modules[module].table;
+	int param = modules[module].param;
+
+	printf("OK\n");
+	printf("Available commands:\n");
+
+	if(table->notes)
+		printf("%s", table->notes);
+
+	printf("\n");
+	printf("%s help - write this text\n", modules[module].name);
+
+	for(int i = 0; i < table->count; i++)
+	{
+		const struct command *command = &table->commands[i];
+
+		if(!command->description)
+			continue;
+
+		if(command->params && !(command->params & (1 << param)))
+			continue;
+
+		print_usage(modules[module].name, command);
+	}
+
+	printf("\n");
+}
+
+/*******************************************************************************
+ * Verify that all tables are sorted, binary search depends on it
+ *
+ * Return value: 0 on success
+ ******************************************************************************/
+int command_init()
+{
+	int ret = 0;
+
+	for(int i = 1; i < module_count; i++)
+	{
+		if(strcmp(modules[i - 1].name, modules[i].name) >= 0)
+		{
+			printf("ERR Command modules not sorted at %s\n", modules[i].name);
+			ret = -1;
+		}
+	}
+
+	for(int i = 0; i < module_count; i++)
+	{
+		const struct command_table *table = modules[i].table;
+
+		for(int j = 1; j < table->count; j++)
+		{
+			if(strcmp(table->commands[j - 1].name, table->commands[j].name) >= 0)
+			{
+				printf("ERR Command table %s not sorted at %s\n",
+				       modules[i].name, table->commands[j].name);
+				ret = -1;
+			}
+		}
+	}
+
+	return ret;
+}
+
+/*******************************************************************************
+ * Look up and run command from words, end is the end of the original line
+ ******************************************************************************/
+static void dispatch(char **words, int count, char *end)
+{
+	/* Make sure we have a command */
+	if(count == 0)
+		goto einval;
+
+	if(strcmp(words[0], "help") == 0 && count == 1)
+	{
+		print_help();
+		return;
+	}
+
+	int module = find_module(words[0]);
+
+	if(module < 0)
+	{
+		printf("ERR Unknown command\n");
+		return;
+	}
+
+	if(count == 2 && strcmp(words[1], "help") == 0)
+	{
+		print_module_help(module);
+		return;
+	}
+
+	int depth;
+	int param = modules[module].param;
+	const struct command *command =
+		find_command(modules[module].table, &words[1], count - 1, &depth);
+
+	if(!command)
+		goto einval;
+
+	if(command->params && !(command->params & (1 << param)))
+		goto einval;
+
+	/* Parse and validate arguments */
+	union command_value values[COMMAND_MAX_ARGS];
+	int word = 1 + depth;
+	int nargs = 0;
+
+	for(; nargs < COMMAND_MAX_ARGS && command->args[nargs].name; nargs++)
+	{
+		const struct command_arg *arg = &command->args[nargs];
+
+		if(word >= count)
+		{
+			if(!(arg->flags & ARG_OPTIONAL))
+				goto einval;
+
+			break;
+		}
+
+		if(arg->type == ARG_REST)
+		{
+			/* Restore separators up to end of line */
+			for(char *c = words[word]; c < end; c++)
+				if(!*c)
+					*c = ' ';
+
+			values[nargs].s = words[word];
+			word = count;
+			continue;
+		}
+
+		if(parse_arg(arg, words[word++], &values[nargs]) < 0)
+			goto einval;
+	}
+
+	/* Too many arguments */
+	if(word < count)
+		goto einval;
+
+	command->handler(param, values, nargs);
+
+	return;
+
+einval:
+	printf(EINVAL);
+	return;
+}
+
+/*******************************************************************************
+ * Run a command line, optionally prefixed with a tag #<tag>. All responses
+ * to a tagged command are prefixed with the same tag, also when they are
+ * written later by another thread.
+ ******************************************************************************/
+void command_dispatch(char *line)
+{
+	char *words[1 + COMMAND_MAX_WORDS + 1];
+	char *end = line + strlen(line);
+	int count = 0;
+
+	/* Split line into words */
+	for(char *c = line; c < end && count <= COMMAND_MAX_WORDS + 1;)
+	{
+		while(*c == ' ')
+			*c++ = 0;
+
+		if(!*c)
+			break;
+
+		words[count++] = c;
+
+		while(*c && *c != ' ')
+			c++;
+	}
+
+	/* Make sure we have a command */
+	if(count == 0)
+		return;
+
+	if(words[0][0] == '#')
+	{
+		const char *digit = &words[0][1];
+		int32_t value = 0;
+
+		/* Decimal digits only, at most INT32_MAX */
+		do
+		{
+			if(*digit < '0' || *digit > '9' ||
+			   value > (INT32_MAX - (*digit - '0')) / 10)
+			{
+				printf(EINVAL);
+				return;
+			}
+
+			value = 10 * value + (*digit++ - '0');
+		}
+		while(*digit);
+
+		hci_set_tag(value);
+		dispatch(&words[1], count - 1, end);
+		hci_set_tag(HCI_NO_TAG);
+	}
+	else
+		dispatch(words, count, end);
+}
@@ -0,0 +1,72 @@
+#pragma once
+/*
+ * Table driven command dispatch
+ *
+ * Every module declares a command table sorted by command name, the module
+ * tables are listed in the sorted module table in command.c. A command line
+ * <module> <command> [arguments]... is looked up with binary search in both
+ * tables, the longest matching command name is used. Arguments are parsed and
+ * validated against the argument schema of the command before the handler is
+ * called. Help texts are generated from the same tables.
+ */
+
+#include <stdint.h>
+
+#define COMMAND_MAX_ARGS 8
+
+enum command_arg_type
+{
+	ARG_INT = 0, /* Decimal integer in range [min, max] */
+	ARG_U32,     /* Unsigned 32-bit decimal integer */
+	ARG_FLOAT,   /* Floating point value */
+	ARG_WORD,    /* Single word */
+	ARG_REST,    /* Rest of line including spaces, must be last */
+	ARG_ONOFF,   /* on/off, parsed into 1/0 */
+	ARG_CHOICE   /* One of choices separated by '|', parsed into index */
+};
+
+/* Argument flags */
+#define ARG_OPTIONAL (1 << 0) /* May be left out, only followed by optionals */
+#define ARG_OR_OFF (1 << 1)   /* ARG_INT may also be "off" */
+
+/* Value of an ARG_OR_OFF argument given as "off" */
+#define ARG_OFF INT32_MIN
+
+struct command_arg
+{
+	const char *name; /* NULL terminates argument list */
+	uint8_t type;
+	uint8_t flags;
+	int32_t min;
+	int32_t max;
+	const char *choices;
+};
+
+union command_value
+{
+	int32_t i;
+	uint32_t u;
+	float f;
+	const char *s;
+};
+
+struct command
+{
+	const char *name; /* Command name, may be several words */
+	const char *description; /* NULL hides the command from help */
+	void (*handler)(int param, const union command_value *args, int count);
+	struct command_arg args[COMMAND_MAX_ARGS];
+	uint8_t params; /* Bit mask of module params allowed, 0 = all */
+};
+
+struct command_table
+{
+	const char *notes; /* Printed before the commands in help, may be NULL */
+	const struct command *commands;
+	int count;
+};
+
+#define COMMAND_COUNT(commands) (sizeof(commands) / sizeof(commands[0]))
+
+int command_init();
+void command_dispatch(char *line);
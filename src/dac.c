@@ -118,122 +118,85 @@ int dac_init()
 	return 0;
 }
 
-void dac_command(int dac)
+static void dac_cmd_voltage(int dac, const union command_value *args, int count)
 {
-	char *cmd = strtok(NULL, " ");
+	float voltage = args[0].f;
 
-	/* Make sure we have a command */
-	if(!cmd)
-		goto einval;
-
-	/*
-	 * Compare commande against known commands and handle them, otherwise tell
-	 * the user it was invalid.
-	 */
-	if(strcmp(cmd, "help") == 0)
-	{
-		printf("OK\n");
-		printf(
-			"Available commands:\n"
-			"\n"
-			"dac%d voltage <voltage> - set dac voltage\n"
-			"dac%d raw <value> - set dac raw value (0-255)\n"
-			"dac%d config 10x [on/off] - set or get current amplification\n"
-			"\n", dac, dac, dac);
-	}
-	else if(strcmp(cmd, "voltage") == 0)
+	if(dac_config[dac].flags & DAC_FLAG_AMP10X)
 	{
-		/* Read value argument */
-		const char *arg = strtok(NULL, " ");
-		if(!arg)
-			goto einval;
-
-		float voltage = strtof(arg, NULL);
-
-		if(dac_config[dac].flags & DAC_FLAG_AMP10X)
+		if(voltage < 0 || voltage > 33)
 		{
-			if(voltage < 0 || voltage > 33)
-				goto einval;
+			printf(EINVAL);
+			return;
+		}
 
-			uint8_t value =
-				(voltage - dac_config[dac].min_10x) * 80 /
-				(dac_config[dac].max_10x - dac_config[dac].min_10x);
+		uint8_t value =
+			(voltage - dac_config[dac].min_10x) * 80 /
+			(dac_config[dac].max_10x - dac_config[dac].min_10x);
 
-			dac_output_voltage(dac_channel[dac], value);
-		}
-		else
-		{
-			int value =
-				(voltage - dac_config[dac].min_1x) * 255 /
-				(dac_config[dac].max_1x - dac_config[dac].min_1x);
+		dac_output_voltage(dac_channel[dac], value);
+	}
+	else
+	{
+		int value =
+			(voltage - dac_config[dac].min_1x) * 255 /
+			(dac_config[dac].max_1x - dac_config[dac].min_1x);
 
-			uint8_t dac_value;
+		uint8_t dac_value;
 
-			if(value < 0)
-				dac_value = 0;
+		if(value < 0)
+			dac_value = 0;
 
-			else if(value > 255)
-				dac_value = 255;
+		else if(value > 255)
+			dac_value = 255;
 
-			else
-				dac_value = value;
+		else
+			dac_value = value;
 
-			dac_output_voltage(dac_channel[dac], dac_value);
-		}
+		dac_output_voltage(dac_channel[dac], dac_value);
 	}
-	else if(strcmp(cmd, "raw") == 0)
-	{
-		/* Read value argument */
-		const char *arg = strtok(NULL, " ");
-		if(!arg)
-			goto einval;
 
-		int raw = atoi(arg);
+	printf("OK\n");
+}
 
-		if(raw < 0 || raw > 255)
-			goto einval;
+static void dac_cmd_raw(int dac, const union command_value *args, int count)
+{
+	dac_output_voltage(dac_channel[dac], args[0].i);
+	printf("OK\n");
+}
 
-		dac_output_voltage(dac_channel[dac], raw);
-		printf("OK\n");
-	}
-	else if(strcmp(cmd, "config") == 0)
+static void dac_cmd_config_10x(int dac, const union command_value *args, int count)
+{
+	if(count == 0)
 	{
-		/* Read value argument */
-		const char *arg = strtok(NULL, " ");
-		if(!arg)
-			goto einval;
-
-		if(strcmp(arg, "10x") == 0)
-		{
-			const char *value_str = strtok(NULL, " ");
-			if(!value_str)
-			{
-				if(dac_config[dac].flags & DAC_FLAG_AMP10X)
-					printf("OK on\n");
-				else
-					printf("OK off\n");
-			}
-			else
-			{
-				if(strcmp(value_str, "on") == 0)
-					dac_config[dac].flags |= DAC_FLAG_AMP10X;
-				else if(strcmp(value_str, "off") == 0)
-					dac_config[dac].flags &= ~DAC_FLAG_AMP10X;
-				else
-					goto einval;
-
-				printf("OK\n");
-			}
-		}
+		if(dac_config[dac].flags & DAC_FLAG_AMP10X)
+			printf("OK on\n");
 		else
-			goto einval;
+			printf("OK off\n");
+
+		return;
 	}
-	else
-		goto einval;
 
-	return;
+	if(args[0].i)
+		dac_config[dac].flags |= DAC_FLAG_AMP10X;
+	else
+		dac_config[dac].flags &= ~DAC_FLAG_AMP10X;
 
-einval:
-	printf(EINVAL);
-	return;
+	printf("OK\n");
 }
+
+/* Must be sorted by name */
+static const struct command dac_commands[] =
+{
+	{ "config 10x", "set or get current amplification", dac_cmd_config_10x,
+		{ { "on/off", ARG_ONOFF, ARG_OPTIONAL } } },
+	{ "raw", "set dac raw value (0-255)", dac_cmd_raw,
+		{ { "value", ARG_INT, 0, 0, 255 } } },
+	{ "voltage", "set dac voltage", dac_cmd_voltage,
+		{ { "voltage", ARG_FLOAT } } },
+};
+
+const struct command_table dac_command_table =
+{
+	NULL, dac_commands, COMMAND_COUNT(dac_commands)
+};
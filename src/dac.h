@@ -1,5 +1,7 @@
 #pragma once
 
+#include "command.h"
+
 enum dac
 {
 	DAC0 = 0,
@@ -8,4 +10,5 @@ enum dac
 };
 
 int dac_init();
-void dac_command(int dac);
+
+extern const struct command_table dac_command_table;
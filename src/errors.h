@@ -3,3 +3,5 @@
 #define EINVAL "ERR Invalid argument\n"
 #define ENOTIME "ERR Time allocation not available\n"
 #define ENOPARAM "ERR No such parameter\n"
+#define ENOMEM "ERR Not enough memory\n"
+#define EABORTED "ERR Aborted\n"
@@ -0,0 +1,228 @@
+/*
+ *  This file is part of SWT21 lab kit firmware.
+ *
+ *  SWT21 lab kit firmware is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  SWT21 lab kit firmware is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with SWT21 lab kit firmware.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ *  Copyright 2021 Joachim Lublin, Binäs Teknik AB
+ */
+
+#include <string.h>
+
+#include "fmt.h"
+
+/* Two lower case hex digits for every byte value */
+static const char hex_table[] =
+	"000102030405060708090a0b0c0d0e0f"
+	"101112131415161718191a1b1c1d1e1f"
+	"202122232425262728292a2b2c2d2e2f"
+	"303132333435363738393a3b3c3d3e3f"
+	"404142434445464748494a4b4c4d4e4f"
+	"505152535455565758595a5b5c5d5e5f"
+	"606162636465666768696a6b6c6d6e6f"
+	"707172737475767778797a7b7c7d7e7f"
+	"808182838485868788898a8b8c8d8e8f"
+	"909192939495969798999a9b9c9d9e9f"
+	"a0a1a2a3a4a5a6a7a8a9aaabacadaeaf"
+	"b0b1b2b3b4b5b6b7b8b9babbbcbdbebf"
+	"c0c1c2c3c4c5c6c7c8c9cacbcccdcecf"
+	"d0d1d2d3d4d5d6d7d8d9dadbdcdddedf"
+	"e0e1e2e3e4e5e6e7e8e9eaebecedeeef"
+	"f0f1f2f3f4f5f6f7f8f9fafbfcfdfeff";
+
+/*******************************************************************************
+ *
+ ******************************************************************************/
+char *fmt_str(char *p, const char *str)
+{
+	int len = strlen(str);
+
+	memcpy(p, str, len);
+
+	return p + len;
+}
+
+/*******************************************************************************
+ * Same as %02x
+ ******************************************************************************/
+char *fmt_hex8(char *p, uint8_t value)
+{
+	p[0] = hex_table[2 * value];
+	p[1] = hex_table[2 * value + 1];
+
+	return p + 2;
+}
+
+/*******************************************************************************
+ * Same as %02x for every byte
+ ******************************************************************************/
+char *fmt_hex(char *p, const uint8_t *data, int len)
+{
+	for(int i = 0; i < len; i++)
+	{
+		p[0] = hex_table[2 * data[i]];
+		p[1] = hex_table[2 * data[i] + 1];
+		p += 2;
+	}
+
+	return p;
+}
+
+/*******************************************************************************
+ * Same as %03x for every 12-bit value
+ ******************************************************************************/
+char *fmt_hex12(char *p, const uint16_t *data, int len)
+{
+	return fmt_hex12_stride(p, data, len, 1);
+}
+
+/*******************************************************************************
+ * As fmt_hex12() for every stride value of data
+ ******************************************************************************/
+char *fmt_hex12_stride(char *p, const uint16_t *data, int len, int stride)
+{
+	for(int i = 0; i < len; i++, data += stride)
+	{
+		uint8_t low = *data & 0xff;
+
+		p[0] = "0123456789abcdef"[(*data >> 8) & 0xf];
+		p[1] = hex_table[2 * low];
+		p[2] = hex_table[2 * low + 1];
+		p += 3;
+	}
+
+	return p;
+}
+
+/*******************************************************************************
+ * Same as %04x for every 16-bit value
+ ******************************************************************************/
+char *fmt_hex16(char *p, const uint16_t *data, int len)
+{
+	for(int i = 0; i < len; i++)
+	{
+		p[0] = hex_table[2 * (data[i] >> 8)];
+		p[1] = hex_table[2 * (data[i] >> 8) + 1];
+		p[2] = hex_table[2 * (data[i] & 0xff)];
+		p[3] = hex_table[2 * (data[i] & 0xff) + 1];
+		p += 4;
+	}
+
+	return p;
+}
+
+/*******************************************************************************
+ * Same as %x
+ ******************************************************************************/
+char *fmt_hex32(char *p, uint32_t value)
+{
+	int digits = 1;
+
+	while(digits < 8 && (value >> (4 * digits)))
+		digits += 1;
+
+	for(int i = digits - 1; i >= 0; i--)
+	{
+		p[i] = "0123456789abcdef"[value & 0xf];
+		value >>= 4;
+	}
+
+	return p + digits;
+}
+
+/*******************************************************************************
+ * Same as %u
+ ******************************************************************************/
+char *fmt_uint(char *p, uint32_t value)
+{
+	char buf[10];
+	int n = 0;
+
+	do
+	{
+		buf[n++] = '0' + value % 10;
+		value /= 10;
+	}
+	while(value);
+
+	while(n > 0)
+		*p++ = buf[--n];
+
+	return p;
+}
+
+/*******************************************************************************
+ * Same as %d
+ ******************************************************************************/
+char *fmt_int(char *p, int32_t value)
+{
+	if(value < 0)
+	{
+		*p++ = '-';
+		return fmt_uint(p, -(uint32_t)value);
+	}
+
+	return fmt_uint(p, value);
+}
+
+/*******************************************************************************
+ * Same as %.1f of tenths / 10
+ ******************************************************************************/
+char *fmt_tenths(char *p, int32_t tenths)
+{
+	uint32_t value = tenths;
+
+	if(tenths < 0)
+	{
+		*p++ = '-';
+		value = -value;
+	}
+
+	p = fmt_uint(p, value / 10);
+	*p++ = '.';
+	*p++ = '0' + value % 10;
+
+	return p;
+}
+
+/*******************************************************************************
+ * Same as %llu, split in 32-bit parts to avoid most 64-bit divisions
+ ******************************************************************************/
+char *fmt_uint64(char *p, uint64_t value)
+{
+	if(value <= UINT32_MAX)
+		return fmt_uint(p, value);
+
+	uint32_t low = value % 1000000000;
+	p = fmt_uint64(p, value / 1000000000);
+
+	for(int i = 8; i >= 0; i--)
+	{
+		p[i] = '0' + low % 10;
+		low /= 10;
+	}
+
+	return p + 9;
+}
+
+/*******************************************************************************
+ * Timestamp prefix of unsolicited messages, "@<us> "
+ ******************************************************************************/
+char *fmt_timestamp(char *p, uint64_t time)
+{
+	*p++ = '@';
+	p = fmt_uint64(p, time);
+	*p++ = ' ';
+
+	return p;
+}
@@ -0,0 +1,21 @@
+#pragma once
+/*
+ * Formatting fast path for hot loops, used instead of printf when building
+ * records. All functions write at p without NUL termination and return a
+ * pointer to the end of the written text.
+ */
+
+#include <stdint.h>
+
+char *fmt_str(char *p, const char *str);
+char *fmt_hex8(char *p, uint8_t value);
+char *fmt_hex(char *p, const uint8_t *data, int len);
+char *fmt_hex12(char *p, const uint16_t *data, int len);
+char *fmt_hex12_stride(char *p, const uint16_t *data, int len, int stride);
+char *fmt_hex16(char *p, const uint16_t *data, int len);
+char *fmt_hex32(char *p, uint32_t value);
+char *fmt_uint(char *p, uint32_t value);
+char *fmt_int(char *p, int32_t value);
+char *fmt_tenths(char *p, int32_t tenths);
+char *fmt_uint64(char *p, uint64_t value);
+char *fmt_timestamp(char *p, uint64_t time);
@@ -24,73 +24,582 @@
 #include <esp_task_wdt.h>
 #include <driver/uart.h>
 
+#include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdarg.h>
 
 #include "config.h"
+#include "errors.h"
+#include "command.h"
 #include "hci.h"
 #include "periodic.h"
-#include "adc.h"
-#include "dac.h"
-#include "calibration.h"
-#include "can.h"
-#include "led.h"
-#include "lin.h"
-#include "uart.h"
-
-static void hci_line_handler(char *line);
+#include "timebase.h"
 
 static const int uart = UART_NUM_0;
 static QueueHandle_t uart_queue;
 static QueueSetHandle_t hci_queue_set;
 
-/* TX functionality */
-#define TX_SLOTS 10
+static volatile uint8_t hci_flags;
+static const uint8_t HCI_FLAG_BINARY = 1 << 0;
+static const uint8_t HCI_FLAG_ECHO = 1 << 1;
+
+/* Binary framing */
+#define FRAME_MAX_PAYLOAD 1280
+
+/*
+ * TX ring, written lock-free by any number of producers and drained by
+ * hci_tx_thread only.
+ *
+ * Producers reserve space by moving head with compare-and-swap, copy their
+ * data after a 4 byte header and then commit the record by writing the header.
+ * The drainer only passes committed records in order and zeroes consumed
+ * space so that a reserved but uncommitted header always reads as zero.
+ */
+#define TX_RING_SIZE (16 * 1024) /* Must be a power of two */
+#define TX_CHUNK_SIZE 4096
+/* app_main, the tasks created in main.c and the esp_timer task */
+#define TX_PRODUCERS 9
+
+static const uint32_t TX_RECORD_COMMIT = 1u << 31;
+static const uint32_t TX_RECORD_DEFERRED = 1u << 30;
+static const uint32_t TX_RECORD_FRAME = 1u << 29;
+static const uint32_t TX_RECORD_FLAGS = TX_RECORD_COMMIT | TX_RECORD_DEFERRED |
+                                        TX_RECORD_FRAME;
+
+/*
+ * A deferred record holds no data, only how to render it. hci_tx_thread
+ * renders it straight into the UART chunk and releases it when the chunk is
+ * written.
+ */
+#define TX_DEFERRED_MAX 16
+
+struct tx_deferred
+{
+	hci_render_t render;
+	hci_release_t release;
+	uint16_t size; /* Maximum bytes rendered */
+	uint8_t context[HCI_DEFERRED_CONTEXT];
+};
+
+/* Bytes of queued deferred records, counted as ring usage for congestion */
+static uint32_t tx_deferred_bytes;
+
+static struct
+{
+	uint32_t head; /* Free running, reserved by producers */
+	uint32_t tail; /* Free running, released by drainer */
+	uint8_t buf[TX_RING_SIZE] __attribute__((aligned(4)));
+} tx_ring;
+
+/* Per task TX state */
 static struct
 {
-	uint16_t period; /* 0 = inactive */
+	TaskHandle_t task; /* NULL = unused */
+	uint32_t records;
+	uint32_t drops;
+	uint32_t high_water;
+	int32_t tag; /* Response tag */
+} tx_producers[TX_PRODUCERS];
+
+static TaskHandle_t tx_task;
+
+/*******************************************************************************
+ * CRC-16/CCITT-FALSE (poly 0x1021, init 0xffff)
+ ******************************************************************************/
+static uint16_t crc16(uint16_t crc, const uint8_t *data, int len)
+{
+	for(int i = 0; i < len; i++)
+	{
+		crc ^= data[i] << 8;
+
+		for(int j = 0; j < 8; j++)
+		{
+			if(crc & 0x8000)
+				crc = (crc << 1) ^ 0x1021;
+			else
+				crc <<= 1;
+		}
+	}
+
+	return crc;
+}
+
+/*******************************************************************************
+ * COBS encode a frame made of several segments into out, the frame delimiter
+ * (0x00) is appended.
+ *
+ * Return value: number of bytes written to out
+ ******************************************************************************/
+static int cobs_encode(uint8_t *out, const uint8_t **segments,
+                       const int *lengths, int count)
+{
+	int code_index = 0;
+	int n = 1;
+	uint8_t code = 1;
+
+	for(int s = 0; s < count; s++)
+	{
+		for(int i = 0; i < lengths[s]; i++)
+		{
+			uint8_t c = segments[s][i];
+
+			if(c != 0)
+			{
+				out[n++] = c;
+				code += 1;
+			}
+
+			if(c == 0 || code == 0xff)
+			{
+				out[code_index] = code;
+				code_index = n++;
+				code = 1;
+			}
+		}
+	}
+
+	out[code_index] = code;
+	out[n++] = 0;
+
+	return n;
+}
+
+/*******************************************************************************
+ * May be called from other threads
+ *
+ * Return value: statistics and tag slot of the calling task. A slot is never
+ * shared, so a task beyond TX_PRODUCERS is a fatal error.
+ ******************************************************************************/
+static int hci_tx_producer()
+{
+	TaskHandle_t task = xTaskGetCurrentTaskHandle();
+
+	for(int i = 0; i < TX_PRODUCERS; i++)
+	{
+		TaskHandle_t current = __atomic_load_n(&tx_producers[i].task,
+		                                       __ATOMIC_ACQUIRE);
+
+		if(current == task)
+			return i;
+
+		if(current == NULL)
+		{
+			TaskHandle_t expected = NULL;
+
+			if(__atomic_compare_exchange_n(&tx_producers[i].task, &expected,
+			                               task, 0, __ATOMIC_ACQ_REL,
+			                               __ATOMIC_ACQUIRE))
+			{
+				tx_producers[i].tag = HCI_NO_TAG;
+				return i;
+			}
+
+			/* Someone else claimed the slot, it may have been us */
+			if(expected == task)
+				return i;
+		}
+	}
+
+	assert(!"TX_PRODUCERS too small for the tasks that print");
+	abort();
+}
+
+/*******************************************************************************
+ * Copy to/from/zero ring buffer positions, handles wrap around
+ ******************************************************************************/
+static void tx_ring_write(uint32_t pos, const uint8_t *data, int len)
+{
+	uint32_t index = pos & (TX_RING_SIZE - 1);
+	int first = TX_RING_SIZE - index;
+
+	if(first > len)
+		first = len;
+
+	memcpy(&tx_ring.buf[index], data, first);
+	memcpy(&tx_ring.buf[0], data + first, len - first);
+}
+
+static void tx_ring_read(uint32_t pos, uint8_t *data, int len)
+{
+	uint32_t index = pos & (TX_RING_SIZE - 1);
+	int first = TX_RING_SIZE - index;
+
+	if(first > len)
+		first = len;
+
+	memcpy(data, &tx_ring.buf[index], first);
+	memcpy(data + first, &tx_ring.buf[0], len - first);
+}
+
+static void tx_ring_clear(uint32_t pos, int len)
+{
+	uint32_t index = pos & (TX_RING_SIZE - 1);
+	int first = TX_RING_SIZE - index;
+
+	if(first > len)
+		first = len;
+
+	memset(&tx_ring.buf[index], 0, first);
+	memset(&tx_ring.buf[0], 0, len - first);
+}
+
+/*******************************************************************************
+ * May be called from other threads, never blocks. Data that does not fit in
+ * the ring is dropped as a whole and counted for the calling task.
+ *
+ * Return value: 0 if written, -1 if dropped
+ ******************************************************************************/
+static int hci_write_record(const uint8_t *data, int len, uint32_t flags)
+{
+	int producer = hci_tx_producer();
+	uint32_t size = (4 + len + 3) & ~3;
+	uint32_t head = __atomic_load_n(&tx_ring.head, __ATOMIC_RELAXED);
+	uint32_t used;
+
+	if(len <= 0)
+		return 0;
+
+	if(len > TX_CHUNK_SIZE)
+		goto drop;
+
+	/* Reserve space */
+	do
+	{
+		uint32_t tail = __atomic_load_n(&tx_ring.tail, __ATOMIC_ACQUIRE);
+
+		used = head - tail + size;
+
+		if(used > TX_RING_SIZE)
+			goto drop;
+	}
+	while(!__atomic_compare_exchange_n(&tx_ring.head, &head, head + size, 1,
+	                                   __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+
+	/* Copy data and commit */
+	tx_ring_write(head + 4, data, len);
+	__atomic_store_n((uint32_t*)&tx_ring.buf[head & (TX_RING_SIZE - 1)],
+	                 len | flags | TX_RECORD_COMMIT, __ATOMIC_RELEASE);
+
+	__atomic_fetch_add(&tx_producers[producer].records, 1, __ATOMIC_RELAXED);
+	if(used > tx_producers[producer].high_water)
+		tx_producers[producer].high_water = used;
+
+	if(tx_task)
+		xTaskNotifyGive(tx_task);
+
+	return 0;
+
+drop:
+	__atomic_fetch_add(&tx_producers[producer].drops, 1, __ATOMIC_RELAXED);
+	return -1;
+}
+
+static void hci_write(const uint8_t *data, int len)
+{
+	hci_write_record(data, len, 0);
+}
+
+/*******************************************************************************
+ * May be called from other threads
+ ******************************************************************************/
+int hci_binary_mode()
+{
+	return hci_flags & HCI_FLAG_BINARY;
+}
+
+/*******************************************************************************
+ * May be called from other threads
+ *
+ * Encode a binary record frame into out, which must hold
+ * HCI_FRAME_SIZE(len) bytes.
+ *
+ * Return value: number of bytes written to out
+ ******************************************************************************/
+int hci_frame_record(uint8_t *out, uint8_t type, uint8_t sequence,
+                     const uint8_t *data, int len)
+{
+	uint8_t header[2];
+	uint8_t trailer[2];
+
+	if(len > FRAME_MAX_PAYLOAD)
+		len = FRAME_MAX_PAYLOAD;
+
+	header[0] = type;
+	header[1] = sequence;
+
+	uint16_t crc = crc16(0xffff, header, 2);
+	crc = crc16(crc, data, len);
+	trailer[0] = crc & 0xff;
+	trailer[1] = crc >> 8;
+
+	const uint8_t *segments[] = { header, data, trailer };
+	const int lengths[] = { 2, len, 2 };
+
+	return cobs_encode(out, segments, lengths, 3);
+}
+
+/*******************************************************************************
+ * May be called from other threads
+ *
+ * Send a binary record, a frame is COBS encoded and consists of
+ * <type> <sequence> <payload>... <crc16 lo> <crc16 hi> followed by 0x00.
+ *
+ * The record is queued as <type> <payload>... and framed by hci_tx_thread,
+ * which numbers frames in the order they leave the ring.
+ ******************************************************************************/
+void hci_send_record(uint8_t type, const uint8_t *data, int len)
+{
+	uint8_t buf[1 + FRAME_MAX_PAYLOAD];
+
+	if(len > FRAME_MAX_PAYLOAD)
+		len = FRAME_MAX_PAYLOAD;
+
+	buf[0] = type;
+	memcpy(&buf[1], data, len);
+
+	hci_write_record(buf, 1 + len, TX_RECORD_FRAME);
+}
+
+/*******************************************************************************
+ * May be called from other threads, never blocks
+ *
+ * Queue output that is rendered by the TX thread when it is written to UART,
+ * so data referenced by context is not copied on the way. render writes at
+ * most size bytes and is given the frame sequence number to use in binary
+ * mode, assigned in ring order when it is rendered. release is called when the output has been written to UART, or at
+ * once if the output is dropped.
+ *
+ * Return value: 0 if queued, -1 if dropped
+ ******************************************************************************/
+int hci_write_deferred(hci_render_t render, hci_release_t release,
+                       const void *context, int context_len, int size)
+{
+	struct tx_deferred deferred =
+	{
+		.render = render,
+		.release = release,
+		.size = size
+	};
+
+	if(context_len > HCI_DEFERRED_CONTEXT || size > TX_CHUNK_SIZE)
+		goto drop;
+
+	memcpy(deferred.context, context, context_len);
+
+	__atomic_fetch_add(&tx_deferred_bytes, size, __ATOMIC_RELAXED);
+
+	if(hci_write_record((uint8_t*)&deferred, sizeof(deferred),
+	                    TX_RECORD_DEFERRED) < 0)
+	{
+		__atomic_fetch_sub(&tx_deferred_bytes, size, __ATOMIC_RELAXED);
+		goto drop;
+	}
+
+	return 0;
+
+drop:
+	release(context);
+	return -1;
+}
+
+/*******************************************************************************
+ * May be called from other threads
+ *
+ * Set the response tag of the calling thread, all text written by the thread
+ * is prefixed with the tag until it is set to HCI_NO_TAG.
+ ******************************************************************************/
+void hci_set_tag(int tag)
+{
+	tx_producers[hci_tx_producer()].tag = tag;
+}
+
+/*******************************************************************************
+ * May be called from other threads
+ ******************************************************************************/
+int hci_get_tag()
+{
+	return tx_producers[hci_tx_producer()].tag;
+}
+
+/*******************************************************************************
+ * May be called from other threads
+ ******************************************************************************/
+void hci_print_str(const char *format, ...)
+{
+	va_list arglist;
+	va_start(arglist, format);
+
+	/* Text of at most 1023 bytes, with room for tags of some lines */
+	char buf[1024 + 128];
+	int tag = hci_get_tag();
+	int n = 0; /* Tag prefix, "#<tag> " */
+
+	if(tag != HCI_NO_TAG)
+		n = snprintf(buf, 16, "#%d ", tag);
+
+	int len = vsnprintf(&buf[n], 1024, format, arglist);
+
+	va_end(arglist);
+
+	if(len < 0)
+		len = 0;
+
+	if(len > 1023)
+		len = 1023;
+
+	len += n;
+
+	/* Prefix every other line too, moving text back from the end */
+	if(tag != HCI_NO_TAG)
+	{
+		const int max = sizeof(buf) - 1;
+		int lines = 0;
+
+		for(int i = n; i < len - 1; i++)
+			if(buf[i] == '\n')
+				lines += 1;
+
+		int dst = len + lines * n;
+
+		for(int src = len - 1; dst > src + 1; src--)
+		{
+			if(--dst < max)
+				buf[dst] = buf[src];
+
+			if(buf[src - 1] != '\n')
+				continue;
+
+			for(int i = n - 1; i >= 0; i--)
+				if(--dst < max)
+					buf[dst] = buf[i];
+		}
+
+		len += lines * n;
+
+		if(len > max)
+			len = max;
+	}
+
+	if(hci_binary_mode())
+		hci_send_record(HCI_RECORD_TEXT, (uint8_t*)buf, len);
+	else
+		hci_write((uint8_t*)buf, len);
+}
+
+/*******************************************************************************
+ * May be called from other threads
+ ******************************************************************************/
+void hci_print_bytes(const uint8_t *data, int len)
+{
+	if(hci_binary_mode())
+		hci_send_record(HCI_RECORD_TEXT, data, len);
+	else
+		hci_write(data, len);
+}
+
+/*
+ * TX scheduling
+ *
+ * Streaming sources allocate a TX slot with the bandwidth they need and a
+ * priority. The available budget, 90 % of the link, is granted to slots in
+ * priority order and every slot gets a token bucket with its granted rate.
+ * Records from a slot without tokens are throttled and summarized later. Low
+ * and normal priority slots are also throttled when the TX ring is filling up
+ * so that command responses, which are not scheduled, always fit.
+ */
+#define TX_SLOTS 10
+static struct tx_slot
+{
+	const char *name;
+	uint16_t period; /* ms, 0 = inactive */
 	uint16_t bytes;
+	uint8_t priority;
+	uint32_t rate; /* Granted bytes per second */
+	int64_t tokens; /* Bytes * 1000000 */
+	int64_t last_refill; /* us */
+	uint32_t sent; /* Bytes */
+	uint32_t throttled; /* Records */
+	uint32_t unreported; /* Records throttled since last summary */
 } tx_scheduling[TX_SLOTS];
 
+static portMUX_TYPE tx_scheduling_lock = portMUX_INITIALIZER_UNLOCKED;
+
 static const int baudrate = 2000000;
 static const int bytes_per_second = baudrate / 10;
 
+/*******************************************************************************
+ * Must be called with tx_scheduling_lock held
+ ******************************************************************************/
+static void tx_rebalance()
+{
+	/* Only allow 90 % TX to periodic data */
+	uint32_t budget = bytes_per_second * 9 / 10;
+
+	for(int priority = HCI_TX_PRIO_HIGH; priority >= HCI_TX_PRIO_LOW; priority--)
+	{
+		for(int i = 0; i < TX_SLOTS; i++)
+		{
+			if(tx_scheduling[i].period == 0 ||
+			   tx_scheduling[i].priority != priority)
+				continue;
+
+			uint32_t requested =
+				tx_scheduling[i].bytes * 1000 / tx_scheduling[i].period;
+
+			if(requested > budget)
+				requested = budget;
+
+			tx_scheduling[i].rate = requested;
+			budget -= requested;
+		}
+	}
+}
+
 /*******************************************************************************
  * May be called from other threads
  *
+ * Reserve bytes every period ms with priority. A slot is always allocated if
+ * one is free but may be granted less than requested, see hci tx.
+ *
  * Return value: TX handle
  ******************************************************************************/
-int hci_alloc_tx_slot(uint16_t period, uint16_t bytes)
+int hci_alloc_tx_slot(uint16_t period, uint16_t bytes, uint8_t priority,
+                      const char *name)
 {
 	int slot = -1;
-	float bytes_per_tick = 0;
 
 	if(period == 0)
 		return -1;
 
+	portENTER_CRITICAL(&tx_scheduling_lock);
+
 	for(int i = 0; i < TX_SLOTS; i++)
 	{
-		if(slot < 0 && tx_scheduling[i].period == 0)
+		if(tx_scheduling[i].period == 0)
+		{
 			slot = i;
-
-		if(tx_scheduling[i].period != 0)
-			bytes_per_tick +=
-				tx_scheduling[i].bytes / (float) tx_scheduling[i].period;
+			break;
+		}
 	}
 
-	if(slot < 0)
-		return -1;
-
-	bytes_per_tick += bytes / (float) period;
+	if(slot >= 0)
+	{
+		tx_scheduling[slot].name = name;
+		tx_scheduling[slot].period = period;
+		tx_scheduling[slot].bytes = bytes;
+		tx_scheduling[slot].priority = priority;
+		tx_scheduling[slot].tokens = (int64_t)bytes * 1000000;
+		tx_scheduling[slot].last_refill = timebase_now();
+		tx_scheduling[slot].sent = 0;
+		tx_scheduling[slot].throttled = 0;
+		tx_scheduling[slot].unreported = 0;
 
-	/* Only allow 90 % TX to periodic data */
-	if(bytes_per_tick / bytes_per_second > 0.9)
-		return -1;
+		tx_rebalance();
+	}
 
-	tx_scheduling[slot].period = period;
-	tx_scheduling[slot].bytes = bytes;
+	portEXIT_CRITICAL(&tx_scheduling_lock);
 
 	return slot;
 }
@@ -100,31 +609,152 @@ int hci_alloc_tx_slot(uint16_t period, uint16_t bytes)
  ******************************************************************************/
 void hci_free_tx_slot(int tx_handle)
 {
+	if(tx_handle < 0 || tx_handle >= TX_SLOTS)
+		return;
+
+	portENTER_CRITICAL(&tx_scheduling_lock);
+
 	tx_scheduling[tx_handle].period = 0;
+	tx_rebalance();
+
+	portEXIT_CRITICAL(&tx_scheduling_lock);
+}
+
+/*******************************************************************************
+ * Ring usage including deferred records, as seen by congestion control
+ ******************************************************************************/
+static uint32_t tx_ring_usage()
+{
+	return __atomic_load_n(&tx_ring.head, __ATOMIC_RELAXED) -
+		__atomic_load_n(&tx_ring.tail, __ATOMIC_RELAXED) +
+		__atomic_load_n(&tx_deferred_bytes, __ATOMIC_RELAXED);
 }
 
 /*******************************************************************************
  * May be called from other threads
+ *
+ * Take tokens for a record of bytes from a TX slot before writing it. When
+ * a slot is allowed to write again after being throttled a summary line is
+ * written first.
+ *
+ * Return value: 0 if the record may be written, -1 if it shall be dropped
  ******************************************************************************/
-void hci_print_str(const char *format, ...)
+int hci_tx_slot_take(int tx_handle, int bytes)
 {
-	va_list arglist;
-	va_start(arglist, format);
+	if(tx_handle < 0 || tx_handle >= TX_SLOTS)
+		return 0;
 
-	char buf[1024];
-	vsnprintf(buf, 1023, format, arglist);
-	buf[1023] = 0;
-	uart_write_bytes(uart, buf, strlen(buf));
+	uint32_t usage = tx_ring_usage();
+	int64_t now = timebase_now();
+	int64_t cost = (int64_t)bytes * 1000000;
+	uint32_t unreported = 0;
+	const char *name;
+	int ret;
 
-	va_end(arglist);
+	portENTER_CRITICAL(&tx_scheduling_lock);
+
+	struct tx_slot *slot = &tx_scheduling[tx_handle];
+
+	/* Refill bucket, allow a burst of one period */
+	int64_t burst = (int64_t)slot->bytes * 1000000;
+
+	slot->tokens += (now - slot->last_refill) * slot->rate;
+	slot->last_refill = now;
+
+	if(slot->tokens > burst)
+		slot->tokens = burst;
+
+	int congested =
+		(slot->priority == HCI_TX_PRIO_LOW && usage > TX_RING_SIZE / 2) ||
+		(slot->priority == HCI_TX_PRIO_NORMAL && usage > TX_RING_SIZE * 3 / 4);
+
+	if(!congested && slot->tokens >= cost)
+	{
+		slot->tokens -= cost;
+		slot->sent += bytes;
+		unreported = slot->unreported;
+		slot->unreported = 0;
+		ret = 0;
+	}
+	else
+	{
+		slot->throttled += 1;
+		slot->unreported += 1;
+		ret = -1;
+	}
+
+	name = slot->name;
+
+	portEXIT_CRITICAL(&tx_scheduling_lock);
+
+	if(unreported)
+		printf("TX throttled %s %u\n", name, unreported);
+
+	return ret;
 }
 
 /*******************************************************************************
  * May be called from other threads
+ *
+ * As hci_tx_slot_take() for data that is kept until it is sent, a failed poll
+ * means try again later and is not counted as throttled. Without a slot it
+ * waits for the ring to be less than 3/4 full. A record larger than the burst
+ * of the slot waits for a full bucket.
+ *
+ * Return value: 0 if the record may be written, -1 if not yet
  ******************************************************************************/
-void hci_print_bytes(const uint8_t *data, int len)
+int hci_tx_slot_poll(int tx_handle, int bytes)
 {
-	uart_write_bytes(uart, (const char*)data, len);
+	int congested = tx_ring_usage() + bytes > TX_RING_SIZE * 3 / 4;
+	int ret = -1;
+
+	if(tx_handle < 0 || tx_handle >= TX_SLOTS)
+		return congested ? -1 : 0;
+
+	int64_t now = timebase_now();
+	int64_t cost = (int64_t)bytes * 1000000;
+
+	portENTER_CRITICAL(&tx_scheduling_lock);
+
+	struct tx_slot *slot = &tx_scheduling[tx_handle];
+
+	int64_t burst = (int64_t)slot->bytes * 1000000;
+
+	slot->tokens += (now - slot->last_refill) * slot->rate;
+	slot->last_refill = now;
+
+	if(slot->tokens > burst)
+		slot->tokens = burst;
+
+	if(!congested && slot->tokens >= (cost < burst ? cost : burst))
+	{
+		slot->tokens -= cost;
+		slot->sent += bytes;
+		ret = 0;
+	}
+
+	portEXIT_CRITICAL(&tx_scheduling_lock);
+
+	return ret;
+}
+
+/*******************************************************************************
+ * May be called from other threads
+ *
+ * Return value: granted bytes per second of a TX slot
+ ******************************************************************************/
+uint32_t hci_tx_slot_rate(int tx_handle)
+{
+	uint32_t rate;
+
+	if(tx_handle < 0 || tx_handle >= TX_SLOTS)
+		return 0;
+
+	portENTER_CRITICAL(&tx_scheduling_lock);
+	rate = tx_scheduling[tx_handle].rate;
+	portEXIT_CRITICAL(&tx_scheduling_lock);
+
+	return rate;
 }
 
 /*******************************************************************************
@@ -176,6 +806,8 @@ void hci_init()
 	uart_param_config(uart, &uart_config);
 	uart_driver_install(uart, 1024, 8192, 10, &uart_queue, 0);
 
+	hci_flags |= HCI_FLAG_ECHO;
+
 	const char *reset_reason = get_reset_reason();
 
 	printf("SWT21 lab kit\nBooting...\n");
@@ -183,10 +815,102 @@ void hci_init()
 	printf("Source code revision: %s\n", GIT_REV);
 	printf("Reset reason: %s\n\n", reset_reason);
 
+	command_init();
+
 	/* Clear RX buffer */
 	uart_flush(uart);
 }
 
+/*******************************************************************************
+ * Drains the TX ring, merging committed records into as large UART writes as
+ * possible.
+ ******************************************************************************/
+void hci_tx_thread(void *parameters)
+{
+	static uint8_t buf[TX_CHUNK_SIZE];
+	static struct tx_deferred deferred[TX_DEFERRED_MAX];
+	static uint8_t frame[1 + FRAME_MAX_PAYLOAD];
+	uint8_t sequence = 0;
+
+	esp_task_wdt_delete(xTaskGetCurrentTaskHandle());
+
+	tx_task = xTaskGetCurrentTaskHandle();
+
+	while(1)
+	{
+		uint32_t tail = tx_ring.tail;
+		int n = 0;
+		int deferred_count = 0;
+
+		while(1)
+		{
+			uint32_t header = __atomic_load_n(
+				(uint32_t*)&tx_ring.buf[tail & (TX_RING_SIZE - 1)],
+				__ATOMIC_ACQUIRE);
+
+			/* Stop at first uncommitted record to keep order */
+			if(!(header & TX_RECORD_COMMIT))
+				break;
+
+			int len = header & ~TX_RECORD_FLAGS;
+			uint32_t size = (4 + len + 3) & ~3;
+
+			if(header & TX_RECORD_DEFERRED)
+			{
+				if(deferred_count == TX_DEFERRED_MAX)
+					break;
+
+				struct tx_deferred *d = &deferred[deferred_count];
+
+				tx_ring_read(tail + 4, (uint8_t*)d, len);
+
+				if(n + d->size > TX_CHUNK_SIZE)
+					break;
+
+				n += d->render(&buf[n], sequence++, d->context);
+				deferred_count += 1;
+
+				__atomic_fetch_sub(&tx_deferred_bytes, d->size, __ATOMIC_RELAXED);
+			}
+			else if(header & TX_RECORD_FRAME)
+			{
+				/* Frames are numbered here to follow ring order */
+				if(n + HCI_FRAME_SIZE(len - 1) > TX_CHUNK_SIZE)
+					break;
+
+				tx_ring_read(tail + 4, frame, len);
+				n += hci_frame_record(&buf[n], frame[0], sequence++, &frame[1],
+				                      len - 1);
+			}
+			else
+			{
+				if(n + len > TX_CHUNK_SIZE)
+					break;
+
+				tx_ring_read(tail + 4, &buf[n], len);
+				n += len;
+			}
+
+			tx_ring_clear(tail, size);
+			tail += size;
+		}
+
+		if(tail != tx_ring.tail)
+		{
+			__atomic_store_n(&tx_ring.tail, tail, __ATOMIC_RELEASE);
+
+			if(n > 0)
+				uart_write_bytes(uart, (const char*)buf, n);
+
+			/* Data of deferred records may be reused once written */
+			for(int i = 0; i < deferred_count; i++)
+				deferred[i].release(deferred[i].context);
+		}
+		else
+			ulTaskNotifyTake(pdTRUE, 100 / portTICK_RATE_MS);
+	}
+}
+
 /*******************************************************************************
  *
  ******************************************************************************/
@@ -202,6 +926,10 @@ void hci_thread(void *parameters)
 
 	char line[buffer_size];
 	int index = 0;
+	int too_long = 0;
+
+	uint8_t rx[256];
+	uint8_t echo[3 * sizeof(rx)]; /* Backspace echoes three characters */
 
 	while(1)
 	{
@@ -219,45 +947,79 @@ void hci_thread(void *parameters)
 
 			while(1)
 			{
-				uint8_t c;
-				int ret = uart_read_bytes(uart, &c, 1, 100 / portTICK_RATE_MS);
+				/* Read everything available in the driver buffer at once */
+				int ret = uart_read_bytes(uart, rx, sizeof(rx), 0);
 
 				/* If we did not receive any character then break loop */
-				if(ret != 1)
+				if(ret <= 0)
 					break;
 
-				/* Convert DEL (0x7f) into backspace (0x08), needed in some terminals */
-				if(c == '\x7f')
-					c = '\b';
+				int do_echo = (hci_flags & HCI_FLAG_ECHO) && !hci_binary_mode();
+				int echo_len = 0;
 
-				/* Handle backspace specifically */
-				if(c == '\b')
+				for(int i = 0; i < ret; i++)
 				{
-					if(index > 0)
+					uint8_t c = rx[i];
+
+					/* Convert DEL (0x7f) into backspace (0x08), needed in some terminals */
+					if(c == '\x7f')
+						c = '\b';
+
+					/* Handle backspace specifically */
+					if(c == '\b')
 					{
-						index -= 1;
-						printf("\b \b"); /* Back, overwrite with space and back again */
+						if(index > 0)
+						{
+							index -= 1;
+
+							/* Back, overwrite with space and back again */
+							memcpy(&echo[echo_len], "\b \b", 3);
+							echo_len += 3;
+						}
+					}
+					/* Handle new line */
+					else if(c == '\n')
+					{
+						echo[echo_len++] = '\n';
+
+						/* Echo must be written before any response */
+						if(do_echo)
+							hci_write(echo, echo_len);
+						echo_len = 0;
+
+						line[index] = 0;
+
+						if(too_long)
+							printf("ERR Command too long\n");
+						else
+							command_dispatch(line);
+
+						index = 0;
+						too_long = 0;
+
+						/* Echo settings may have been changed by the command */
+						do_echo = (hci_flags & HCI_FLAG_ECHO) && !hci_binary_mode();
+					}
+					/* Ignore all other control characters */
+					else if(c < 0x20)
+					{
+						continue;
+					}
+					/* Drop characters that do not fit in the line */
+					else if(index >= buffer_size - 1)
+					{
+						too_long = 1;
+					}
+					/* Otherwise echo character written */
+					else
+					{
+						echo[echo_len++] = c;
+						line[index++] = c;
 					}
 				}
-				/* Handle new line */
-				else if(c == '\n')
-				{
-					printf("\n");
-					line[index] = 0;
-					hci_line_handler(line);
-					index = 0;
-				}
-				/* Ignore all other control characters */
-				else if(c < 0x20)
-				{
-					continue;
-				}
-				/* Otherwise echo character written */
-				else
-				{
-					uart_write_bytes(uart, (char*)&c, 1);
-					line[index++] = c;
-				}
+
+				if(do_echo && echo_len > 0)
+					hci_write(echo, echo_len);
 			}
 		}
 	}
@@ -266,61 +1028,169 @@ void hci_thread(void *parameters)
 /*******************************************************************************
  *
  ******************************************************************************/
-static void hci_line_handler(char *line)
+static void hci_cmd_mode(int param, const union command_value *args, int count)
 {
-	char *cmd = strtok(line, " ");
-
-	/* Make sure we have a command */
-	if(cmd == NULL)
+	if(count == 0)
+	{
+		printf("OK %s\n", hci_binary_mode() ? "binary" : "ascii");
 		return;
+	}
 
 	/*
-	 * Compare commande against known commands and handle them, otherwise tell
-	 * the user it was invalid.
+	 * The response is sent in the mode that was active when the command
+	 * was received.
 	 */
-	if(strcmp(cmd, "help") == 0)
+	printf("OK\n");
+
+	if(args[0].i)
+		hci_flags |= HCI_FLAG_BINARY;
+	else
+		hci_flags &= ~HCI_FLAG_BINARY;
+}
+
+/*******************************************************************************
+ *
+ ******************************************************************************/
+static void hci_cmd_echo(int param, const union command_value *args, int count)
+{
+	if(count == 0)
+	{
+		printf("OK %s\n", (hci_flags & HCI_FLAG_ECHO) ? "on" : "off");
+		return;
+	}
+
+	if(args[0].i)
+		hci_flags |= HCI_FLAG_ECHO;
+	else
+		hci_flags &= ~HCI_FLAG_ECHO;
+
+	printf("OK\n");
+}
+
+/*******************************************************************************
+ *
+ ******************************************************************************/
+static void hci_cmd_stats(int param, const union command_value *args, int count)
+{
+	int producers = 0;
+
+	for(int i = 0; i < TX_PRODUCERS; i++)
+		if(tx_producers[i].task)
+			producers += 1;
+
+	printf("OK %d %d\n", producers, TX_RING_SIZE);
+
+	for(int i = 0; i < TX_PRODUCERS; i++)
 	{
-		printf("OK\n");
-		printf(
-			"Available commands:\n"
-			"\n"
-			"help - write this text\n"
-			"adc0 help - write all adc0 commands\n"
-			"adc1 help - write all adc1 commands\n"
-			"dac0 help - write all dac0 commands\n"
-			"dac1 help - write all dac1 commands\n"
-			"calibration help - write all calibration commands\n"
-			"can help - write all can commands\n"
-			"led help - write all led commands\n"
-			"\n");
+		if(!tx_producers[i].task)
+			continue;
+
+		printf("%s\t%u\t%u\t%u\n",
+		       pcTaskGetTaskName(tx_producers[i].task),
+		       tx_producers[i].records,
+		       tx_producers[i].drops,
+		       tx_producers[i].high_water);
 	}
-	else if(strcmp(cmd, "adc0") == 0)
-		adc_command(0);
+}
 
-	else if(strcmp(cmd, "adc1") == 0)
-		adc_command(1);
+/*******************************************************************************
+ *
+ ******************************************************************************/
+static void hci_cmd_stats_reset(int param, const union command_value *args,
+                                int count)
+{
+	for(int i = 0; i < TX_PRODUCERS; i++)
+	{
+		tx_producers[i].records = 0;
+		tx_producers[i].drops = 0;
+		tx_producers[i].high_water = 0;
+	}
 
-	else if(strcmp(cmd, "dac0") == 0)
-		dac_command(0);
+	printf("OK\n");
+}
 
-	else if(strcmp(cmd, "dac1") == 0)
-		dac_command(1);
+/*******************************************************************************
+ *
+ ******************************************************************************/
+static void hci_cmd_tx(int param, const union command_value *args, int count)
+{
+	static const char *priorities[] = { "low", "normal", "high" };
+	struct tx_slot slots[TX_SLOTS];
+	int active = 0;
 
-	else if(strcmp(cmd, "calibration") == 0)
-		calibration_command();
+	/* Copy to not print with lock held */
+	portENTER_CRITICAL(&tx_scheduling_lock);
+	memcpy(slots, tx_scheduling, sizeof(slots));
+	portEXIT_CRITICAL(&tx_scheduling_lock);
 
-	else if(strcmp(cmd, "can") == 0)
-		can_command();
+	for(int i = 0; i < TX_SLOTS; i++)
+		if(slots[i].period)
+			active += 1;
 
-	else if(strcmp(cmd, "led") == 0)
-		led_command();
+	printf("OK %d %d\n", active, bytes_per_second * 9 / 10);
 
-	else if(strcmp(cmd, "lin") == 0)
-		lin_command();
+	for(int i = 0; i < TX_SLOTS; i++)
+	{
+		if(!slots[i].period)
+			continue;
 
-	else if(strcmp(cmd, "uart") == 0)
-		uart_command();
+		printf("%s\t%s\t%u\t%u\t%u\t%u\n",
+		       slots[i].name,
+		       priorities[slots[i].priority],
+		       slots[i].bytes * 1000 / slots[i].period,
+		       slots[i].rate,
+		       slots[i].sent,
+		       slots[i].throttled);
+	}
+}
 
-	else
-		printf("ERR Unknown command\n");
+/*******************************************************************************
+ *
+ ******************************************************************************/
+static void hci_cmd_jobs(int param, const union command_value *args, int count)
+{
+	periodic_print_stats();
+}
+
+/*******************************************************************************
+ *
+ ******************************************************************************/
+static void hci_cmd_jobs_reset(int param, const union command_value *args,
+                               int count)
+{
+	periodic_reset_stats();
+	printf("OK\n");
 }
+
+/*******************************************************************************
+ *
+ ******************************************************************************/
+static void hci_cmd_time(int param, const union command_value *args, int count)
+{
+	printf("OK %llu\n", timebase_now());
+}
+
+/* Must be sorted by name */
+static const struct command hci_commands[] =
+{
+	{ "echo", "get or set echo of received characters", hci_cmd_echo,
+		{ { "on/off", ARG_ONOFF, ARG_OPTIONAL } } },
+	{ "jobs", "print scheduled jobs: name, period, runs, missed deadlines, "
+	          "max and recent max lateness in us and lateness histogram",
+		hci_cmd_jobs },
+	{ "jobs reset", "reset job statistics", hci_cmd_jobs_reset },
+	{ "mode", "get or set host interface output mode", hci_cmd_mode,
+		{ { "ascii/binary", ARG_CHOICE, ARG_OPTIONAL, 0, 0, "ascii|binary" } } },
+	{ "stats", "print TX records, drops and high water mark per task",
+		hci_cmd_stats },
+	{ "stats reset", "reset TX statistics", hci_cmd_stats_reset },
+	{ "time", "print device time in us, used for event timestamps",
+		hci_cmd_time },
+	{ "tx", "print TX allocations: name, priority, requested and granted "
+	        "bytes/s, sent bytes and throttled records", hci_cmd_tx },
+};
+
+const struct command_table hci_command_table =
+{
+	NULL, hci_commands, COMMAND_COUNT(hci_commands)
+};
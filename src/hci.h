@@ -1,9 +1,57 @@
 #pragma once
 
+#include "command.h"
+
+enum hci_record
+{
+	HCI_RECORD_TEXT = 0,
+	HCI_RECORD_CAN_RX,
+	HCI_RECORD_LIN_RX,
+	HCI_RECORD_UART_RX,
+	HCI_RECORD_ADC_TRIG,
+	HCI_RECORD_ADC_PERIODIC,
+	HCI_RECORD_ADC_STREAM,
+	HCI_RECORD_ADC_SEGMENT,
+	HCI_RECORD_ADC_SCAN,
+	HCI_RECORD_ADC_AVERAGE,
+	HCI_RECORD_ADC_ENVELOPE
+};
+
+enum hci_tx_priority
+{
+	HCI_TX_PRIO_LOW = 0,
+	HCI_TX_PRIO_NORMAL,
+	HCI_TX_PRIO_HIGH
+};
+
+#define HCI_NO_TAG -1
+
 #define printf(...) hci_print_str(__VA_ARGS__)
 void hci_print_str(const char *format, ...);
 void hci_print_bytes(const uint8_t *data, int len);
-int hci_alloc_tx_slot(uint16_t period, uint16_t bytes);
+void hci_set_tag(int tag);
+int hci_get_tag();
+int hci_binary_mode();
+void hci_send_record(uint8_t type, const uint8_t *data, int len);
+
+/* Bytes needed to frame a record of len bytes */
+#define HCI_FRAME_SIZE(len) ((len) + 4 + ((len) + 4) / 254 + 2)
+int hci_frame_record(uint8_t *out, uint8_t type, uint8_t sequence,
+                     const uint8_t *data, int len);
+
+#define HCI_DEFERRED_CONTEXT 32
+typedef int (*hci_render_t)(uint8_t *out, uint8_t sequence, const void *context);
+typedef void (*hci_release_t)(const void *context);
+int hci_write_deferred(hci_render_t render, hci_release_t release,
+                       const void *context, int context_len, int size);
+int hci_alloc_tx_slot(uint16_t period, uint16_t bytes, uint8_t priority,
+                      const char *name);
 void hci_free_tx_slot(int tx_handle);
+int hci_tx_slot_take(int tx_handle, int bytes);
+int hci_tx_slot_poll(int tx_handle, int bytes);
+uint32_t hci_tx_slot_rate(int tx_handle);
 void hci_init();
 void hci_thread(void *parameters);
+void hci_tx_thread(void *parameters);
+
+extern const struct command_table hci_command_table;
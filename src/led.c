@@ -35,7 +35,9 @@ const int led_pin = GPIO_NUM_23;
 static struct
 {
 	uint8_t flags; /* initialized */
-} led_config;
+	uint8_t state;
+	int blink_job;
+} led_config = { .blink_job = -1 };
 
 const uint8_t LED_FLAG_INIT = 1 << 0;
 
@@ -55,56 +57,70 @@ esp_err:
 	return -1;
 }
 
-void led_command()
+static void led_toggle(void *arg)
 {
-	char *cmd = strtok(NULL, " ");
-
-	/* Make sure we have a command */
-	if(!cmd)
-		goto einval;
-
-	/*
-	 * Compare commande against known commands and handle them, otherwise tell
-	 * the user it was invalid.
-	 */
-	if(strcmp(cmd, "help") == 0)
-	{
-		printf("OK\n");
-		printf(
-			"Available commands:\n"
-			"\n"
-			"led on - \n"
-			"led off - \n"
-			"lin blink [half period] - half period in ms (int, default: 500)\n");
-	}
-	else if(strcmp(cmd, "on") == 0)
-	{
-		led_off(1);
-	}
-	else if(strcmp(cmd, "off") == 0)
-	{
-		led_off(0);
-	}
-	else if(strcmp(cmd, "blink") == 0)
-	{
-		const char *arg = strtok(NULL, " ");
-		int period = 500;
-
-		if(arg)
-			period = atoi(arg);
-
-		led_blink(period, 0);
-	}
+	led_config.state = !led_config.state;
+	led_set_state(led_config.state);
+}
+
+static void led_off(uint8_t state)
+{
+	periodic_remove(led_config.blink_job);
+	led_config.blink_job = -1;
+
+	led_set_state(state);
+	printf("OK\n");
+}
+
+static void led_blink(uint16_t period, uint16_t offset)
+{
+	periodic_remove(led_config.blink_job);
+
+	led_config.state = 0;
+	led_config.blink_job = periodic_add(
+		periodic_align(period * 1000, offset * 1000), period * 1000,
+		led_toggle, NULL, "led");
+
+	if(led_config.blink_job < 0)
+		printf(ENOTIME);
 	else
-		goto einval;
+		printf("OK\n");
+}
 
-	return;
+static void led_cmd_on(int param, const union command_value *args, int count)
+{
+	led_off(1);
+}
+
+static void led_cmd_off(int param, const union command_value *args, int count)
+{
+	led_off(0);
+}
+
+static void led_cmd_blink(int param, const union command_value *args, int count)
+{
+	int period = 500;
+
+	if(count > 0)
+		period = args[0].i;
 
-einval:
-	printf(EINVAL);
-	return;
+	led_blink(period, 0);
 }
 
+/* Must be sorted by name */
+static const struct command led_commands[] =
+{
+	{ "blink", "half period in ms (int, default: 500)", led_cmd_blink,
+		{ { "half period", ARG_INT, ARG_OPTIONAL, 1, 65535 } } },
+	{ "off", "turn off LED", led_cmd_off },
+	{ "on", "turn on LED", led_cmd_on },
+};
+
+const struct command_table led_command_table =
+{
+	NULL, led_commands, COMMAND_COUNT(led_commands)
+};
+
 void led_set_state(int state)
 {
 	gpio_set_level(led_pin, state);
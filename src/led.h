@@ -1,5 +1,8 @@
 #pragma once
 
+#include "command.h"
+
 int led_init();
-void led_command();
 void led_set_state(int state);
+
+extern const struct command_table led_command_table;
@@ -30,6 +30,8 @@
 #include "errors.h"
 #include "lin.h"
 #include "hci.h"
+#include "fmt.h"
+#include "timebase.h"
 
 #define ELINPROTO "LIN RX protocol error\n"
 #define ELINCHKS "LIN RX checksum error\n"
@@ -79,11 +81,13 @@ const uint8_t LIN_FLAG_CHKS_ENHANCED = 1 << 3;
 
 static QueueHandle_t lin_queue;
 static QueueHandle_t uart_queue;
+static int lin_tx_slot = -1;
 static QueueSetHandle_t lin_queue_set;
 
 struct lin_event
 {
 	uint8_t event;
+	int32_t tag;
 
 	union
 	{
@@ -181,230 +185,81 @@ static void send_break(int break_len)
 	uart_set_pin(uart, lin_tx_pin, lin_rx_pin, -1, -1);
 }
 
-void lin_command()
+static void lin_cmd_on(int param, const union command_value *args, int count)
 {
-	char *cmd = strtok(NULL, " ");
-	esp_err_t err;
+	lin_on();
+}
 
-	/* Make sure we have a command */
-	if(!cmd)
-		goto einval;
+static void lin_cmd_off(int param, const union command_value *args, int count)
+{
+	lin_off();
+}
 
-	/*
-	 * Compare commande against known commands and handle them, otherwise tell
-	 * the user it was invalid.
-	 */
-	if(strcmp(cmd, "help") == 0)
-	{
-		printf("OK\n");
-		printf(
-			"Available commands:\n"
-			"<id> is decimal\n"
-			"<data> is hexadecimal\n"
-			"<chks-type> is checksum type with: 0: classic, 1: enhanced\n"
-			"\n"
-			"lin txbuf <id>#<data> - set LIN response data\n"
-			"lin single <id> - send single LIN header\n"
-			"lin config rx <id> <len> <chks-type> - configure LIN id for reading with\n"
-			"                                       len and checksum\n"
-			"lin config rx <id> off - disable reading for id\n"
-			"lin config rx <id> - read current rx state for id\n"
-			"lin config tx <id> <len> <chks-type> - configure LIN id for writing\n"
-			"lin config tx <id> off - disable writing for id\n"
-			"lin config tx <id> - read current tx state for id\n"
-#if 0
-/*
- * LIN schedule is TODO in a later release
- */
-			"lin config master [1/0] - get or set master role\n"
-			"lin config schedule <id> <period> <offset>  - \n"
-			"lin config schedule <id> off - \n"
-			"lin config schedule <id> - get id schedule\n"
-			"lin config schedule - get schedule\n"
-#endif
-			"\n");
-	}
-	else if(strcmp(cmd, "on") == 0)
-	{
-		lin_on();
-	}
-	else if(strcmp(cmd, "off") == 0)
+static void lin_cmd_txbuf(int param, const union command_value *args, int count)
+{
+	struct lin_frame frame;
+
+	memset(&frame, 0, sizeof(frame));
+	if(parse_frame_format(&frame, args[0].s) < 0)
 	{
-		lin_off();
+		printf(EINVAL);
+		return;
 	}
-	else if(strcmp(cmd, "txbuf") == 0)
-	{
-		struct lin_frame frame;
-		const char *frame_str = strtok(NULL, " ");
 
-		memset(&frame, 0, sizeof(frame));
-		if(parse_frame_format(&frame, frame_str) < 0)
-			goto einval;
+	memcpy(config.frame_data[frame.id], frame.data, 8);
 
-		memcpy(config.frame_data[frame.id], frame.data, 8);
+	printf("OK\n");
+}
 
-		printf("OK\n");
-	}
-	else if(strcmp(cmd, "single") == 0)
-	{
-		int id;
-		char *arg;
+static void lin_cmd_single(int param, const union command_value *args, int count)
+{
+	/* Send command */
+	lin_send(args[0].i);
+}
 
-		/* Read id argument */
-		arg = strtok(NULL, " ");
-		if(!arg)
-			goto einval;
+/*
+ * Shared by config rx and config tx, <id> [<len> <chks> | off]
+ */
+static void lin_config_frames(uint64_t *frames, const union command_value *args,
+                              int count)
+{
+	int id = args[0].i;
 
-		id = atoi(arg);
+	if(count == 1)
+	{
+		int enabled = *frames & (1 << id);
+		int len = config.frame_len[id];
+		int chks = config.frame_checksums & (1 << id)? 1 : 0;
 
-		if(id > 63 || id < 0)
-			goto einval;
+		printf("OK %d %d %d\n", enabled, len, chks);
 
-		/* Send command */
-		lin_send(id);
+		return;
 	}
-	else if(strcmp(cmd, "config") == 0)
+
+	if(args[1].i == ARG_OFF)
 	{
-		/* Read config argument */
-		const char *param = strtok(NULL, " ");
-		if(!param)
+		if(count > 2)
 			goto einval;
 
-		if(strcmp(param, "rx") == 0)
-		{
-			/* <id> [<len> <chks>] */
-			int id;
-			int len;
-			int chks;
-			char *arg;
-
-			/* Read id argument */
-			arg = strtok(NULL, " ");
-			if(!arg)
-				goto einval;
-
-			id = atoi(arg);
-
-			if(id > 63 || id < 0)
-				goto einval;
-
-			/* Read len argument */
-			arg = strtok(NULL, " ");
-			if(!arg)
-			{
-				int rx = config.rx_frames & (1 << id);
-				int len = config.frame_len[id];
-				int chks = config.frame_checksums & (1 << id)? 1 : 0;
-
-				printf("OK %d %d %d\n", rx, len, chks);
-
-				return;
-			}
-
-			if(strcmp(arg, "off") == 0)
-			{
-				config.rx_frames &= ~(1 << id);
-				printf("OK\n");
-				return;
-			}
-
-			len = atoi(arg);
-
-			if(len > 8 || len < 1)
-				goto einval;
-
-			config.frame_len[id] = len;
-
-			/* Read chks argument */
-			arg = strtok(NULL, " ");
-			if(!arg)
-				goto einval;
-
-			chks = atoi(arg);
-
-			if(chks == 0)
-				config.frame_checksums &= ~(1 << id);
-
-			else if(chks == 1)
-				config.frame_checksums |= 1 << id;
-
-			else
-				goto einval;
-
-			config.rx_frames |= 1 << id;
-
-			printf("OK\n");
-		}
-
-		else if(strcmp(param, "tx") == 0)
-		{
-			/* <id> [<len> <chks>] */
-			int id;
-			int len;
-			int chks;
-			char *arg;
-
-			/* Read id argument */
-			arg = strtok(NULL, " ");
-			if(!arg)
-				goto einval;
-
-			id = atoi(arg);
-
-			if(id > 63 || id < 0)
-				goto einval;
-
-			/* Read len argument */
-			arg = strtok(NULL, " ");
-			if(!arg)
-			{
-				int tx = config.tx_frames & (1 << id);
-				int len = config.frame_len[id];
-				int chks = config.frame_checksums & (1 << id)? 1 : 0;
-
-				printf("OK %d %d %d\n", tx, len, chks);
-
-				return;
-			}
-
-			if(strcmp(arg, "off") == 0)
-			{
-				config.tx_frames &= ~(1 << id);
-				printf("OK\n");
-				return;
-			}
-
-			len = atoi(arg);
-
-			if(len > 8 || len < 1)
-				goto einval;
-
-			config.frame_len[id] = len;
-
-			/* Read chks argument */
-			arg = strtok(NULL, " ");
-			if(!arg)
-				goto einval;
-
-			chks = atoi(arg);
-
-			if(chks == 0)
-				config.frame_checksums &= ~(1 << id);
-
-			else if(chks == 1)
-				config.frame_checksums |= 1 << id;
+		*frames &= ~(1 << id);
+		printf("OK\n");
+		return;
+	}
 
-			else
-				goto einval;
+	/* Checksum type is required when setting length */
+	if(count < 3)
+		goto einval;
 
-			config.tx_frames |= 1 << id;
+	config.frame_len[id] = args[1].i;
 
-			printf("OK\n");
-		}
-	}
+	if(args[2].i == CHECKSUM_TYPE_ENHANCED)
+		config.frame_checksums |= 1 << id;
 	else
-		goto einval;
+		config.frame_checksums &= ~(1 << id);
 
+	*frames |= 1 << id;
+
+	printf("OK\n");
 	return;
 
 einval:
@@ -412,11 +267,54 @@ einval:
 	return;
 }
 
+static void lin_cmd_config_rx(int param, const union command_value *args, int count)
+{
+	lin_config_frames(&config.rx_frames, args, count);
+}
+
+static void lin_cmd_config_tx(int param, const union command_value *args, int count)
+{
+	lin_config_frames(&config.tx_frames, args, count);
+}
+
+/* Must be sorted by name */
+static const struct command lin_commands[] =
+{
+	/* LIN config master and config schedule is TODO in a later release */
+	{ "config rx", "configure LIN id for reading with len and checksum, "
+	               "off to disable or only id to read current state",
+		lin_cmd_config_rx,
+		{ { "id", ARG_INT, 0, 0, 63 },
+		  { "len/off", ARG_INT, ARG_OPTIONAL | ARG_OR_OFF, 1, 8 },
+		  { "chks-type", ARG_INT, ARG_OPTIONAL, 0, 1 } } },
+	{ "config tx", "configure LIN id for writing with len and checksum, "
+	               "off to disable or only id to read current state",
+		lin_cmd_config_tx,
+		{ { "id", ARG_INT, 0, 0, 63 },
+		  { "len/off", ARG_INT, ARG_OPTIONAL | ARG_OR_OFF, 1, 8 },
+		  { "chks-type", ARG_INT, ARG_OPTIONAL, 0, 1 } } },
+	{ "off", NULL, lin_cmd_off },
+	{ "on", NULL, lin_cmd_on },
+	{ "single", "send single LIN header", lin_cmd_single,
+		{ { "id", ARG_INT, 0, 0, 63 } } },
+	{ "txbuf", "set LIN response data", lin_cmd_txbuf,
+		{ { "id#data", ARG_WORD } } },
+};
+
+const struct command_table lin_command_table =
+{
+	"<id> is decimal\n"
+	"<data> is hexadecimal\n"
+	"<chks-type> is checksum type with: 0: classic, 1: enhanced\n",
+	lin_commands, COMMAND_COUNT(lin_commands)
+};
+
 void lin_off()
 {
 	struct lin_event event =
 	{
-		.event = EVENT_LIN_OFF
+		.event = EVENT_LIN_OFF,
+		.tag = hci_get_tag()
 	};
 
 	xQueueSendToBack(lin_queue, &event, 0);
@@ -426,7 +324,8 @@ void lin_on()
 {
 	struct lin_event event =
 	{
-		.event = EVENT_LIN_ON
+		.event = EVENT_LIN_ON,
+		.tag = hci_get_tag()
 	};
 
 	xQueueSendToBack(lin_queue, &event, 0);
@@ -437,6 +336,7 @@ void lin_send(int id)
 	struct lin_event event =
 	{
 		.event = EVENT_LIN_SEND,
+		.tag = hci_get_tag(),
 		.send.id = id
 	};
 
@@ -496,14 +396,41 @@ static uint8_t checksum_data(uint8_t id, uint8_t *data, int len)
 	return checksum;
 }
 
-static void handle_lin_rx(uint8_t id, uint8_t *data, int len)
+static void handle_lin_rx(uint64_t time, uint8_t id, uint8_t *data, int len)
 {
-	char buf[17];
+	/* Record size estimate, ASCII: "@<time> LIN RX: 63#" + data + "\n" */
+	int size = hci_binary_mode() ? 16 + len : 32 + 2 * len;
 
-	for(int i = 0; i < len; i++)
-		sprintf(&buf[2*i], "%02x", data[i]);
+	if(hci_tx_slot_take(lin_tx_slot, size) < 0)
+		return;
+
+	if(hci_binary_mode())
+	{
+		/* <time (u64 le)> <id> <data>... */
+		uint8_t record[8 + 1 + 8];
+
+		for(int i = 0; i < 8; i++)
+			record[i] = (time >> (8 * i)) & 0xff;
+
+		record[8] = id;
+		memcpy(&record[9], data, len);
+
+		hci_send_record(HCI_RECORD_LIN_RX, record, 9 + len);
+		return;
+	}
 
-	printf("LIN RX: %d#%s\n", id, buf);
+	/* "@<time> LIN RX: 63#0011223344556677\n" */
+	char buf[56];
+	char *p = buf;
+
+	p = fmt_timestamp(p, time);
+	p = fmt_str(p, "LIN RX: ");
+	p = fmt_uint(p, id);
+	*p++ = '#';
+	p = fmt_hex(p, data, len);
+	*p++ = '\n';
+
+	hci_print_bytes((uint8_t*)buf, p - buf);
 }
 
 static void send_lin_header(int id)
@@ -523,6 +450,9 @@ void lin_thread(void *parameters)
 	while(!(lin_config.flags & LIN_FLAG_INIT))
 		vTaskDelay(100 * portTICK_PERIOD_MS);
 
+	/* At most about 100 frames/s at 19200 baud */
+	lin_tx_slot = hci_alloc_tx_slot(10, 50, HCI_TX_PRIO_NORMAL, "lin");
+
 	lin_queue_set = xQueueCreateSet(20);
 	xQueueAddToSet(uart_queue, lin_queue_set);
 	xQueueAddToSet(lin_queue, lin_queue_set);
@@ -540,6 +470,7 @@ void lin_thread(void *parameters)
 	} state = STATE_IDLE;
 
 	uint8_t current_id = 0;
+	uint64_t frame_time = 0; /* Time of break */
 	uint8_t data_len = 0;
 	uint8_t data_read = 0;
 	uint8_t data_rx[8];
@@ -621,7 +552,7 @@ void lin_thread(void *parameters)
 						if(c != checksum)
 							printf(ELINCHKS);
 						else
-							handle_lin_rx(current_id, data_rx, data_len);
+							handle_lin_rx(frame_time, current_id, data_rx, data_len);
 
 						state = STATE_IDLE;
 
@@ -634,6 +565,7 @@ void lin_thread(void *parameters)
 							id_pending &= ~(1 << i);
 							current_id = i;
 
+							frame_time = timebase_now();
 							send_lin_header(current_id);
 							state = STATE_WAIT_DATA;
 						}
@@ -646,6 +578,8 @@ void lin_thread(void *parameters)
 			}
 			else if(event.type == UART_BREAK)
 			{
+				frame_time = timebase_now();
+
 				uint8_t c;
 				int ret = uart_read_bytes(uart, &c, 1, 10);
 
@@ -661,6 +595,8 @@ void lin_thread(void *parameters)
 
 			if(xQueueReceive(lin_queue, &event, 0))
 			{
+				hci_set_tag(event.tag);
+
 				if(event.event == EVENT_LIN_OFF)
 				{
 					rx_running = 0;
@@ -678,6 +614,7 @@ void lin_thread(void *parameters)
 					if(state == STATE_IDLE)
 					{
 						current_id = event.send.id;
+						frame_time = timebase_now();
 						send_lin_header(current_id);
 						state = STATE_WAIT_DATA;
 					}
@@ -686,6 +623,8 @@ void lin_thread(void *parameters)
 
 					printf("OK\n");
 				}
+
+				hci_set_tag(HCI_NO_TAG);
 			}
 		}
 
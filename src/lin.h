@@ -1,8 +1,11 @@
 #pragma once
 
+#include "command.h"
+
 int lin_init();
-void lin_command();
 void lin_off();
 void lin_on();
 void lin_send(int id);
 void lin_thread(void *parameters);
+
+extern const struct command_table lin_command_table;
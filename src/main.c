@@ -47,6 +47,7 @@ int app_main()
 	ESP_ERROR_CHECK(ret);
 
 	hci_init();
+	periodic_init();
 	adc_init();
 	dac_init();
 	can_init();
@@ -55,6 +56,7 @@ int app_main()
 	uart_init();
 
 	xTaskCreatePinnedToCore(&hci_thread, "hci", 10000, NULL, 1, NULL, 0);
+	xTaskCreatePinnedToCore(&hci_tx_thread, "hci_tx", 4096, NULL, 3, NULL, 0);
 	xTaskCreatePinnedToCore(&periodic_thread, "periodic", 10000, NULL, 5, NULL, 0);
 	xTaskCreatePinnedToCore(&adc_trig_thread, "adc_trig", 10000, NULL, 4, NULL, 0);
 	xTaskCreatePinnedToCore(&can_rx_thread, "can", 10000, NULL, 4, NULL, 0);
@@ -19,123 +19,333 @@
 
 #include <freertos/FreeRTOS.h>
 #include <freertos/task.h>
-#include <freertos/queue.h>
+#include <freertos/semphr.h>
 #include <esp_task_wdt.h>
+#include <esp_timer.h>
+
+#include <string.h>
 
 #include "hci.h"
-#include "led.h"
+#include "fmt.h"
+#include "periodic.h"
+#include "timebase.h"
+
+static struct periodic_job
+{
+	const char *name;
+	periodic_callback_t callback; /* NULL = free */
+	void *arg;
+	uint64_t deadline;
+	uint32_t period; /* us, 0 = one-shot */
+	int8_t heap_index; /* -1 = not scheduled */
+
+	/* Statistics, lateness in us */
+	uint32_t runs;
+	uint32_t missed;
+	uint32_t max_late;
+	uint32_t recent_max_late; /* Max of last full second */
+	uint32_t window_max_late; /* Max of current second */
+	uint64_t window_start;
+	uint32_t histogram[PERIODIC_HISTOGRAM_BUCKETS];
+} jobs[PERIODIC_JOBS];
+
+/* Min-heap of job indices ordered by deadline */
+static uint8_t heap[PERIODIC_JOBS];
+static int heap_len;
 
 /*
- * Periodic configuration does not keep the actual configuration but only a copy
- * of the values it needs.
+ * Protects jobs and heap and is held while a callback runs so that a job is
+ * never running when periodic_remove() returns
  */
-static struct
+static SemaphoreHandle_t periodic_lock;
+
+static TaskHandle_t periodic_task;
+static esp_timer_handle_t periodic_timer;
+
+/*******************************************************************************
+ * Heap
+ ******************************************************************************/
+static void heap_swap(int a, int b)
+{
+	uint8_t job = heap[a];
+
+	heap[a] = heap[b];
+	heap[b] = job;
+
+	jobs[heap[a]].heap_index = a;
+	jobs[heap[b]].heap_index = b;
+}
+
+static int heap_before(int a, int b)
 {
-	struct
+	return jobs[heap[a]].deadline < jobs[heap[b]].deadline;
+}
+
+static void heap_sift_up(int i)
+{
+	while(i > 0 && heap_before(i, (i - 1) / 2))
 	{
-		uint32_t next;
-		uint16_t period;
-	} adc[2];
-	struct
+		heap_swap(i, (i - 1) / 2);
+		i = (i - 1) / 2;
+	}
+}
+
+static void heap_sift_down(int i)
+{
+	while(1)
 	{
-		uint32_t next;
-		uint16_t period;
-		uint8_t state;
-	} led;
-} periodic_conf;
+		int first = i;
+		int left = 2 * i + 1;
+		int right = 2 * i + 2;
 
-static uint16_t run_flags;
-static const uint16_t RUN_FLAG_ADC0 = 1 << 0;
-//static const uint16_t RUN_FLAG_ADC1 = 1 << 1;
-static const uint16_t RUN_FLAG_LED = 1 << 2;
+		if(left < heap_len && heap_before(left, first))
+			first = left;
 
-static QueueHandle_t periodic_queue;
+		if(right < heap_len && heap_before(right, first))
+			first = right;
+
+		if(first == i)
+			break;
+
+		heap_swap(i, first);
+		i = first;
+	}
+}
 
-struct periodic_event
+static void heap_push(int job)
 {
-	uint8_t event;
-	union
-	{
-		struct
-		{
-			uint16_t period;
-			uint16_t offset;
-		} adc_periodic;
-		struct
-		{
-			uint8_t state;
-		} led_off;
-		struct
-		{
-			uint16_t period;
-			uint16_t offset;
-		} led_blink;
-	};
-};
+	heap[heap_len] = job;
+	jobs[job].heap_index = heap_len;
+	heap_len += 1;
+
+	heap_sift_up(heap_len - 1);
+}
 
-enum
+static void heap_remove(int i)
 {
-	EVENT_ADC_OFF = 0,
-	EVENT_ADC_PERIODIC,
-	EVENT_LED_OFF,
-	EVENT_LED_BLINK
-};
+	jobs[heap[i]].heap_index = -1;
+	heap_len -= 1;
+
+	if(i == heap_len)
+		return;
+
+	heap[i] = heap[heap_len];
+	jobs[heap[i]].heap_index = i;
+
+	heap_sift_up(i);
+	heap_sift_down(i);
+}
 
 /*******************************************************************************
- *
+ * Locking is skipped in the periodic thread which already holds the lock
+ * while running callbacks
+ ******************************************************************************/
+static void periodic_take()
+{
+	if(xTaskGetCurrentTaskHandle() != periodic_task)
+		xSemaphoreTake(periodic_lock, portMAX_DELAY);
+}
+
+static void periodic_give()
+{
+	if(xTaskGetCurrentTaskHandle() != periodic_task)
+		xSemaphoreGive(periodic_lock);
+}
+
+/*******************************************************************************
+ * Statistics
  ******************************************************************************/
-void adc_off()
+static void periodic_clear_stats(struct periodic_job *job)
 {
-	struct periodic_event event =
+	job->runs = 0;
+	job->missed = 0;
+	job->max_late = 0;
+	job->recent_max_late = 0;
+	job->window_max_late = 0;
+	job->window_start = timebase_now();
+	memset(job->histogram, 0, sizeof(job->histogram));
+}
+
+static void periodic_update_stats(struct periodic_job *job, uint64_t now)
+{
+	uint64_t late64 = now - job->deadline;
+	uint32_t late = late64 > UINT32_MAX ? UINT32_MAX : late64;
+
+	int bucket = late ? 32 - __builtin_clz(late) : 0;
+
+	if(bucket >= PERIODIC_HISTOGRAM_BUCKETS)
+		bucket = PERIODIC_HISTOGRAM_BUCKETS - 1;
+
+	job->runs += 1;
+	job->histogram[bucket] += 1;
+
+	if(late > job->max_late)
+		job->max_late = late;
+
+	if(now - job->window_start >= 1000000)
 	{
-		.event = EVENT_ADC_OFF,
-	};
+		job->recent_max_late = job->window_max_late;
+		job->window_max_late = 0;
+		job->window_start = now;
+	}
 
-	xQueueSendToBack(periodic_queue, &event, 0);
+	if(late > job->window_max_late)
+		job->window_max_late = late;
 }
 
 /*******************************************************************************
- *
+ * Print name, period, runs, missed deadlines, max and recent max lateness
+ * and the lateness histogram of every job
  ******************************************************************************/
-void adc_periodic(uint16_t period, uint16_t offset)
+void periodic_print_stats()
 {
-	struct periodic_event event =
+	struct periodic_job copy[PERIODIC_JOBS];
+	int count = 0;
+
+	periodic_take();
+	memcpy(copy, jobs, sizeof(copy));
+	periodic_give();
+
+	for(int i = 0; i < PERIODIC_JOBS; i++)
+		if(copy[i].callback)
+			count += 1;
+
+	printf("OK %d %d\n", count, PERIODIC_HISTOGRAM_BUCKETS);
+
+	for(int i = 0; i < PERIODIC_JOBS; i++)
 	{
-		.event = EVENT_ADC_PERIODIC,
-		.adc_periodic.period = period,
-		.adc_periodic.offset = offset
-	};
+		struct periodic_job *job = &copy[i];
 
-	xQueueSendToBack(periodic_queue, &event, 0);
+		if(!job->callback)
+			continue;
+
+		char histogram[PERIODIC_HISTOGRAM_BUCKETS * 11];
+		char *p = histogram;
+
+		for(int j = 0; j < PERIODIC_HISTOGRAM_BUCKETS; j++)
+		{
+			if(j > 0)
+				*p++ = ' ';
+			p = fmt_uint(p, job->histogram[j]);
+		}
+		*p = 0;
+
+		uint32_t recent = job->window_max_late > job->recent_max_late ?
+		                  job->window_max_late : job->recent_max_late;
+
+		printf("%s\t%u\t%u\t%u\t%u\t%u\t%s\n",
+		       job->name, job->period, job->runs, job->missed,
+		       job->max_late, recent, histogram);
+	}
 }
 
 /*******************************************************************************
  *
  ******************************************************************************/
-void led_off(uint8_t state)
+void periodic_reset_stats()
+{
+	periodic_take();
+
+	for(int i = 0; i < PERIODIC_JOBS; i++)
+		periodic_clear_stats(&jobs[i]);
+
+	periodic_give();
+}
+
+/*******************************************************************************
+ * Add a job with the first deadline at start, repeated every period us if
+ * period > 0. Returns a job handle or -1 if no job is available.
+ ******************************************************************************/
+int periodic_add(uint64_t start, uint32_t period, periodic_callback_t callback,
+                 void *arg, const char *name)
 {
-	struct periodic_event event =
+	int job;
+
+	periodic_take();
+
+	for(job = 0; job < PERIODIC_JOBS; job++)
+		if(!jobs[job].callback)
+			break;
+
+	if(job == PERIODIC_JOBS)
 	{
-		.event = EVENT_LED_OFF,
-		.led_off.state = state
-	};
+		periodic_give();
+		return -1;
+	}
+
+	jobs[job].name = name;
+	jobs[job].callback = callback;
+	jobs[job].arg = arg;
+	jobs[job].deadline = start;
+	jobs[job].period = period;
+
+	periodic_clear_stats(&jobs[job]);
+
+	heap_push(job);
+
+	periodic_give();
+
+	/* Let the thread sleep until the new first deadline */
+	if(periodic_task)
+		xTaskNotifyGive(periodic_task);
+
+	return job;
+}
+
+/*******************************************************************************
+ * Remove a job, ignores -1. The callback is not running and will not be
+ * called again when this returns.
+ ******************************************************************************/
+void periodic_remove(int job)
+{
+	if(job < 0)
+		return;
+
+	periodic_take();
+
+	if(jobs[job].heap_index >= 0)
+		heap_remove(jobs[job].heap_index);
+
+	jobs[job].callback = NULL;
+
+	periodic_give();
+}
+
+/*******************************************************************************
+ * First time after now which is offset us after a multiple of period
+ ******************************************************************************/
+uint64_t periodic_align(uint32_t period, uint32_t offset)
+{
+	uint64_t now = timebase_now();
+
+	return now - now % period + period + offset;
+}
 
-	xQueueSendToBack(periodic_queue, &event, 0);
+/*******************************************************************************
+ *
+ ******************************************************************************/
+static void periodic_timer_callback(void *arg)
+{
+	xTaskNotifyGive(periodic_task);
 }
 
 /*******************************************************************************
  *
  ******************************************************************************/
-void led_blink(uint16_t period, uint16_t offset)
+void periodic_init()
 {
-	struct periodic_event event =
+	for(int i = 0; i < PERIODIC_JOBS; i++)
+		jobs[i].heap_index = -1;
+
+	periodic_lock = xSemaphoreCreateMutex();
+
+	esp_timer_create_args_t timer_args =
 	{
-		.event = EVENT_LED_BLINK,
-		.led_blink.period = period,
-		.led_blink.offset = offset
+		.callback = periodic_timer_callback,
+		.name = "periodic"
 	};
 
-	xQueueSendToBack(periodic_queue, &event, 0);
+	ESP_ERROR_CHECK(esp_timer_create(&timer_args, &periodic_timer));
 }
 
 /*******************************************************************************
@@ -145,85 +355,67 @@ void periodic_thread(void *parameters)
 {
 	esp_task_wdt_delete(xTaskGetCurrentTaskHandle());
 
-	periodic_queue = xQueueCreate(10, sizeof(struct periodic_event));
-
-	TickType_t current_tick = xTaskGetTickCount();
-	TickType_t previous_tick;
+	periodic_task = xTaskGetCurrentTaskHandle();
 
 	while(1)
 	{
-		previous_tick = current_tick;
-		vTaskDelayUntil(&current_tick, 1);
+		uint64_t next = 0;
+		uint64_t now;
 
-		if(previous_tick + 1 != current_tick)
-			printf("ERR: Periodic overrun!\n"); // Overrun
+		xSemaphoreTake(periodic_lock, portMAX_DELAY);
 
-		if(run_flags & RUN_FLAG_ADC0)
+		now = timebase_now();
+
+		while(heap_len > 0)
 		{
-			if(current_tick >= periodic_conf.adc[0].next)
+			int job = heap[0];
+
+			if(jobs[job].deadline > now)
 			{
-				periodic_conf.adc[0].next += periodic_conf.adc[0].period;
-				printf("ADC0: ...\n");
+				next = jobs[job].deadline;
+				break;
 			}
-		}
 
-		if(run_flags & RUN_FLAG_LED)
-		{
-			if(current_tick >= periodic_conf.led.next)
-			{
-				periodic_conf.led.next += periodic_conf.led.period;
+			periodic_callback_t callback = jobs[job].callback;
+			void *arg = jobs[job].arg;
 
-				periodic_conf.led.state = !periodic_conf.led.state;
-				led_set_state(periodic_conf.led.state);
-			}
-		}
+			heap_remove(0);
 
-		struct periodic_event event;
-		if(xQueueReceive(periodic_queue, &event, 0))
-		{
-			if(event.event == EVENT_ADC_OFF)
-			{
-				run_flags &= ~RUN_FLAG_ADC0;
-				printf("OK\n");
-			}
+			periodic_update_stats(&jobs[job], now);
 
-			else if(event.event == EVENT_ADC_PERIODIC)
+			if(jobs[job].period)
 			{
-				uint16_t period = event.adc_periodic.period;
-				uint16_t offset = event.adc_periodic.offset;
+				jobs[job].deadline += jobs[job].period;
 
-				uint32_t current_offset = current_tick % period;
+				/* Skip deadlines that already passed */
+				if(jobs[job].deadline <= now)
+				{
+					uint32_t missed =
+						(now - jobs[job].deadline) / jobs[job].period + 1;
 
-				periodic_conf.adc[0].period = period;
-				periodic_conf.adc[0].next = current_tick - current_offset + period + offset;
+					jobs[job].missed += missed;
+					jobs[job].deadline += (uint64_t)missed * jobs[job].period;
+				}
 
-				run_flags |= RUN_FLAG_ADC0;
-				printf("OK\n");
+				heap_push(job);
 			}
+			else
+				jobs[job].callback = NULL;
 
-			else if(event.event == EVENT_LED_OFF)
-			{
-				run_flags &= ~RUN_FLAG_LED;
-				led_set_state(event.led_off.state);
-				printf("OK\n");
-			}
-
-			else if(event.event == EVENT_LED_BLINK)
-			{
-				uint16_t period = event.led_blink.period;
-				uint16_t offset = event.led_blink.offset;
+			callback(arg);
 
-				uint32_t current_offset = current_tick % period;
+			now = timebase_now();
+		}
 
-				periodic_conf.led.period = period;
-				periodic_conf.led.next = current_tick - current_offset
-				                         + period + offset;
-				periodic_conf.led.state = 0;
+		xSemaphoreGive(periodic_lock);
 
-				run_flags |= RUN_FLAG_LED;
-				printf("OK\n");
-			}
+		if(next)
+		{
+			esp_timer_stop(periodic_timer);
+			esp_timer_start_once(periodic_timer, next - now);
 		}
 
+		/* Woken by the timer or by a new job */
+		ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
 	}
 }
@@ -1,13 +1,29 @@
 #pragma once
 /*
- * This threads runs every ms and schedules what to do in each millisecond
- * and if it is possible to send it over UART (max 90 % utilization for periodics)
- * An obvious improvment would be to use timers to read the actual data
- * but currently we implement th easiest and fastest implementation.
+ * Scheduler for periodic and one-shot jobs with microsecond resolution.
+ * Jobs are kept in a min-heap ordered by deadline and the periodic thread
+ * sleeps on an esp_timer until the first deadline. Callbacks run in the
+ * periodic thread and may use printf and add or remove jobs.
+ *
+ * Times are in the timebase of timebase_now().
  */
 
+#include <stdint.h>
+
+#define PERIODIC_JOBS 16
+
+/* Lateness histogram, bucket 0 is < 1 us and bucket n is < 2^n us */
+#define PERIODIC_HISTOGRAM_BUCKETS 16
+
+typedef void (*periodic_callback_t)(void *arg);
+
+void periodic_init();
 void periodic_thread(void *parameters);
-void adc_off();
-void adc_periodic(uint16_t period, uint16_t offset);
-void led_off(uint8_t state);
-void led_blink(uint16_t period, uint16_t offset);
+
+int periodic_add(uint64_t start, uint32_t period, periodic_callback_t callback,
+                 void *arg, const char *name);
+void periodic_remove(int job);
+uint64_t periodic_align(uint32_t period, uint32_t offset);
+
+void periodic_print_stats();
+void periodic_reset_stats();
@@ -0,0 +1,27 @@
+/*
+ *  This file is part of SWT21 lab kit firmware.
+ *
+ *  SWT21 lab kit firmware is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  SWT21 lab kit firmware is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with SWT21 lab kit firmware.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ *  Copyright 2021 Joachim Lublin, Binäs Teknik AB
+ */
+
+#include <esp_timer.h>
+
+#include "timebase.h"
+
+uint64_t timebase_now()
+{
+	return esp_timer_get_time();
+}
@@ -0,0 +1,9 @@
+#pragma once
+/*
+ * Device timebase shared by all event sources. Timestamps are microseconds
+ * since boot from esp_timer and never wrap in practice.
+ */
+
+#include <stdint.h>
+
+uint64_t timebase_now();
@@ -27,6 +27,8 @@
 #include "uart.h"
 #include "hci.h"
 #include "errors.h"
+#include "fmt.h"
+#include "timebase.h"
 
 int uart_tx_pin = 17;
 int uart_rx_pin = 5;
@@ -78,160 +80,107 @@ esp_err:
 	return -1;
 }
 
-void uart_command()
+static void uart_cmd_sendline(int param, const union command_value *args,
+                              int count)
 {
-	char *cmd = strtok(NULL, " ");
-	esp_err_t err;
-
-	/* Make sure we have a command */
-	if(!cmd)
-		goto einval;
-
-	/*
-	 * Compare commande against known commands and handle them, otherwise tell
-	 * the user it was invalid.
-	 */
-	if(strcmp(cmd, "help") == 0)
-	{
-		printf("OK\n");
-		printf(
-			"Available commands:\n"
-			"\n"
-			"uart sendline <text> - send text line\n"
-			"uart config baudrate [baudrate] - get or set baudrate\n"
-			"uart config parity [parity] - get or set parity (n/e/o)\n"
-			"uart config stopbits [stopbits] - get or set stopbits (1,2)\n"
-			"\n");
-	}
-	else if(strcmp(cmd, "sendline") == 0)
-	{
-		const char *payload = strtok(NULL, "");
+	const char *payload = args[0].s;
 
-		if(payload == NULL)
-			goto einval;
+	uart_write_bytes(config.uart, payload, strlen(payload));
+	uart_write_bytes(config.uart, "\n", 1);
+	printf("OK\n");
+}
 
-		uart_write_bytes(config.uart, payload, strlen(payload));
-		uart_write_bytes(config.uart, "\n", 1);
-		printf("OK\n");
-	}
-	else if(strcmp(cmd, "config") == 0)
+static void uart_cmd_config_baudrate(int param, const union command_value *args,
+                                     int count)
+{
+	if(count == 0)
 	{
-		/* Read config argument */
-		const char *param = strtok(NULL, " ");
-		if(!param)
-			goto einval;
-
-		if(strcmp(param, "baudrate") == 0)
-		{
-			/* [baudrate] */
-			int baudrate;
-			char *arg;
-
-			/* Read baudrate argument */
-			arg = strtok(NULL, " ");
-			if(!arg)
-			{
-				printf("OK %u\n", config.baudrate);
-				return;
-			}
-
-			baudrate = atoi(arg);
-
-			if(baudrate < 0)
-				goto einval;
-
-			err = uart_set_baudrate(config.uart, baudrate);
-
-			if(err != ESP_OK)
-				goto einval;
-
-			config.baudrate = baudrate;
-			printf("OK\n");
-		}
-		else if(strcmp(param, "parity") == 0)
-		{
-			/* [parity] */
-			char parity;
-			int parity_value;
-			char *arg;
-
-			/* Read parity argument */
-			arg = strtok(NULL, " ");
-			if(!arg)
-			{
-				printf("OK %c\n", config.parity);
-				return;
-			}
-
-			parity = arg[0];
-
-			if(parity == 'n')
-				parity_value = UART_PARITY_DISABLE;
-
-			else if(parity == 'o')
-				parity_value = UART_PARITY_ODD;
-
-			else if(parity == 'e')
-				parity_value = UART_PARITY_EVEN;
-
-			else
-				goto einval;
-
-			err = uart_set_parity(config.uart, parity_value);
+		printf("OK %u\n", config.baudrate);
+		return;
+	}
 
-			if(err != ESP_OK)
-				goto einval;
+	if(uart_set_baudrate(config.uart, args[0].i) != ESP_OK)
+	{
+		printf(EINVAL);
+		return;
+	}
 
-			config.parity = parity;
-			printf("OK\n");
-		}
-		else if(strcmp(param, "stopbits") == 0)
-		{
-			/* [stopbits] */
-			int stopbits;
-			int stopbits_value;
-			char *arg;
-
-			/* Read stopbits argument */
-			arg = strtok(NULL, " ");
-			if(!arg)
-			{
-				printf("OK %u\n", config.stopbits);
-				return;
-			}
+	config.baudrate = args[0].i;
+	printf("OK\n");
+}
 
-			stopbits = atoi(arg);
+static const char uart_parities[] = "noe";
 
-			if(stopbits == 1)
-				stopbits_value = UART_STOP_BITS_1;
+static void uart_cmd_config_parity(int param, const union command_value *args,
+                                   int count)
+{
+	const int parity_values[] =
+	{
+		UART_PARITY_DISABLE,
+		UART_PARITY_ODD,
+		UART_PARITY_EVEN
+	};
 
-			else if(stopbits == 2)
-				stopbits_value = UART_STOP_BITS_2;
+	if(count == 0)
+	{
+		printf("OK %c\n", config.parity);
+		return;
+	}
 
-			else
-				goto einval;
+	if(uart_set_parity(config.uart, parity_values[args[0].i]) != ESP_OK)
+	{
+		printf(EINVAL);
+		return;
+	}
 
-			err = uart_set_stop_bits(config.uart, stopbits_value);
+	config.parity = uart_parities[args[0].i];
+	printf("OK\n");
+}
 
-			if(err != ESP_OK)
-				goto einval;
+static void uart_cmd_config_stopbits(int param, const union command_value *args,
+                                     int count)
+{
+	int stopbits_value;
 
-			config.stopbits = stopbits;
-			printf("OK\n");
-		}
-		else
-			goto einval;
+	if(count == 0)
+	{
+		printf("OK %u\n", config.stopbits);
+		return;
 	}
+
+	if(args[0].i == 1)
+		stopbits_value = UART_STOP_BITS_1;
 	else
-		goto einval;
+		stopbits_value = UART_STOP_BITS_2;
 
-	return;
+	if(uart_set_stop_bits(config.uart, stopbits_value) != ESP_OK)
+	{
+		printf(EINVAL);
+		return;
+	}
 
-einval:
-	printf(EINVAL);
-	return;
+	config.stopbits = args[0].i;
+	printf("OK\n");
 }
 
+/* Must be sorted by name */
+static const struct command uart_commands[] =
+{
+	{ "config baudrate", "get or set baudrate", uart_cmd_config_baudrate,
+		{ { "baudrate", ARG_INT, ARG_OPTIONAL, 0, INT32_MAX } } },
+	{ "config parity", "get or set parity (n/e/o)", uart_cmd_config_parity,
+		{ { "parity", ARG_CHOICE, ARG_OPTIONAL, 0, 0, "n|o|e" } } },
+	{ "config stopbits", "get or set stopbits (1,2)", uart_cmd_config_stopbits,
+		{ { "stopbits", ARG_INT, ARG_OPTIONAL, 1, 2 } } },
+	{ "sendline", "send text line", uart_cmd_sendline,
+		{ { "text", ARG_REST } } },
+};
+
+const struct command_table uart_command_table =
+{
+	NULL, uart_commands, COMMAND_COUNT(uart_commands)
+};
+
 void uart_thread(void *parameters)
 {
 	esp_task_wdt_delete(xTaskGetCurrentTaskHandle());
@@ -239,16 +188,46 @@ void uart_thread(void *parameters)
 	while(!(config.flags & UART_FLAG_INIT))
 		vTaskDelay(100 * portTICK_PERIOD_MS);
 
+	int tx_slot = hci_alloc_tx_slot(1, 36, HCI_TX_PRIO_LOW, "uart");
+
 	while(1)
 	{
 		uint8_t c;
 		int ret = uart_read_bytes(config.uart, &c, 1, 100 / portTICK_RATE_MS);
-		if(ret > 0)
+		uint64_t time = timebase_now();
+
+		/* Record size estimate, ASCII: "@<time> UART: xx c\n" */
+		if(ret > 0 && hci_tx_slot_take(tx_slot, 32) == 0)
 		{
-			if(c < 0x20)
-				printf("UART: %02x\n", c);
+			if(hci_binary_mode())
+			{
+				/* <time (u64 le)> <data> */
+				uint8_t record[8 + 1];
+
+				for(int i = 0; i < 8; i++)
+					record[i] = (time >> (8 * i)) & 0xff;
+
+				record[8] = c;
+
+				hci_send_record(HCI_RECORD_UART_RX, record, 9);
+			}
 			else
-				printf("UART: %02x %c\n", c, c);
+			{
+				/* "@<time> UART: xx c\n", the character only if printable */
+				char buf[40];
+				char *p = fmt_timestamp(buf, time);
+
+				p = fmt_hex8(fmt_str(p, "UART: "), c);
+
+				if(c >= 0x20)
+				{
+					*p++ = ' ';
+					*p++ = c;
+				}
+				*p++ = '\n';
+
+				hci_print_bytes((uint8_t*)buf, p - buf);
+			}
 		}
 	}
 }
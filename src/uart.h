@@ -1,5 +1,8 @@
 #pragma once
 
+#include "command.h"
+
 int uart_init();
-void uart_command();
 void uart_thread(void *parameters);
+
+extern const struct command_table uart_command_table;
@@ -0,0 +1,278 @@
+/*
+ *  This file is part of SWT21 lab kit firmware.
+ *
+ *  SWT21 lab kit firmware is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  SWT21 lab kit firmware is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with SWT21 lab kit firmware.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ *  Copyright 2021 Joachim Lublin, Binäs Teknik AB
+ */
+
+/*
+ * Host test of the ADC trig kernels. The word at a time unpack and trigger
+ * search is compared with the byte at a time unpack and per-value search it
+ * replaced, on random and edge case DMA buffers, and both are timed.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "adc_kernel.h"
+
+#define BLOCK 1024
+
+static uint32_t seed = 1;
+static int failures;
+
+static uint32_t rnd()
+{
+	seed = seed * 1103515245 + 12345;
+	return seed >> 8;
+}
+
+static double now()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/*******************************************************************************
+ * Reference, byte at a time unpack as in the trig thread before the kernels
+ ******************************************************************************/
+static void unpack_bytes(uint16_t *values, const uint32_t *words, int count)
+{
+	const uint8_t *buf = (const uint8_t*)words;
+
+	for(int i = 0; i < count; i++)
+	{
+		/* Same byte order swap as for trig, the I2S FIFO is 32-bit */
+		int j = i ^ 1;
+
+		values[i] = ((buf[2*j+1] << 8) | buf[2*j]) & 0xfff;
+	}
+}
+
+/*******************************************************************************
+ * Reference, the per-value search of the trig thread before the kernels,
+ * equal to level or crossing level
+ ******************************************************************************/
+static int search_any(const uint16_t *values, int count, uint16_t v0,
+                      uint16_t level)
+{
+	for(int i = 0; i < count; i++)
+	{
+		uint16_t v1 = values[i];
+
+		if(v1 == level ||
+		   (v1 > level && v0 < level) ||
+		   (v1 < level && v0 > level))
+			return i;
+
+		v0 = v1;
+	}
+
+	return -1;
+}
+
+/*******************************************************************************
+ * Fill words with count values of a signal, with garbage in the channel bits
+ *
+ * kind 0: flat, 1: ramp, 2: noise, 3: square wave, 4: full scale extremes
+ ******************************************************************************/
+static void fill(uint32_t *words, int count, int kind, uint16_t level)
+{
+	int offset = (int)(rnd() & 0xfff);
+	int slope = (int)(rnd() % 9) - 4;
+	int period = 2 + rnd() % 200;
+
+	for(int i = 0; i < count; i += 2)
+	{
+		uint16_t v[2];
+
+		for(int k = 0; k < 2; k++)
+		{
+			int x = i + k;
+			int value;
+
+			if(kind == 0)
+				value = offset;
+			else if(kind == 1)
+				value = offset + x * slope;
+			else if(kind == 2)
+				value = level + (int)(rnd() % 65) - 32;
+			else if(kind == 3)
+				value = (x / period) & 1 ? level + 300 : level - 300;
+			else
+				value = rnd() & 1 ? 0 : 4095;
+
+			value = value < 0 ? 0 : value > 4095 ? 4095 : value;
+			v[k] = value | (rnd() & 0xf000);
+		}
+
+		words[i / 2] = ((uint32_t)v[0] << 16) | v[1];
+	}
+}
+
+static void check(int ok, const char *what, int mode, int block)
+{
+	if(ok)
+		return;
+
+	if(failures < 20)
+		printf("FAIL %s mode %d block %d\n", what, mode, block);
+
+	failures += 1;
+}
+
+/*******************************************************************************
+ * Run consecutive buffers through both paths, the trigger state is kept
+ * between buffers and re-armed after it fires
+ ******************************************************************************/
+static void test_mode(int mode, int blocks)
+{
+	static uint32_t words[BLOCK / 2];
+	static uint16_t reference[BLOCK];
+	static uint16_t values[BLOCK];
+	static uint16_t strided[2 * BLOCK];
+
+	struct adc_trig config =
+	{
+		.mode = mode,
+		.level = rnd() & 0xfff,
+		.hysteresis = rnd() % 64,
+		.width = rnd() % 300
+	};
+
+	config.high = config.level + rnd() % (4096 - config.level);
+
+	struct adc_trig a = config;
+	struct adc_trig b = config;
+	struct adc_trig c = config;
+	uint16_t prev = rnd() & 0xfff;
+
+	adc_trig_reset(&a, prev);
+	adc_trig_reset(&b, prev);
+	adc_trig_reset(&c, prev);
+
+	for(int block = 0; block < blocks; block++)
+	{
+		/* Even lengths down to one word, mostly full DMA buffers */
+		int count = rnd() & 3 ? BLOCK : 2 + 2 * (rnd() % (BLOCK / 2));
+
+		/* Edge levels every now and then */
+		if(block % 17 == 0)
+		{
+			uint16_t edges[] = { 0, 1, 4094, 4095 };
+
+			a.level = b.level = c.level = edges[rnd() % 4];
+			a.high = b.high = c.high = 4095;
+		}
+
+		fill(words, count, rnd() % 5, a.level);
+
+		unpack_bytes(reference, words, count);
+
+		int found = adc_unpack_trig(&a, values, words, count);
+		int found_reference = adc_trig_search(&b, reference, count);
+
+		check(!memcmp(values, reference, count * sizeof(uint16_t)),
+		      "unpack", mode, block);
+		check(found == found_reference, "found", mode, block);
+		check(a.prev == b.prev && a.armed == b.armed && a.count == b.count,
+		      "state", mode, block);
+
+		/* Same values interleaved with another channel */
+		for(int i = 0; i < count; i++)
+		{
+			strided[2 * i] = rnd() & 0xfff;
+			strided[2 * i + 1] = reference[i];
+		}
+
+		int found_stride = adc_trig_search_stride(&c, &strided[1], count, 2);
+
+		check(found_stride == found_reference, "stride", mode, block);
+
+		if(mode == ADC_TRIG_ANY)
+			check(search_any(reference, count, prev, a.level) == found_reference,
+			      "old search", mode, block);
+
+		prev = reference[found >= 0 ? found : count - 1];
+
+		if(found >= 0)
+		{
+			adc_trig_reset(&a, prev);
+			adc_trig_reset(&b, prev);
+			adc_trig_reset(&c, prev);
+		}
+	}
+}
+
+/*******************************************************************************
+ * Time both paths on buffers that never trig and on noise around the level
+ ******************************************************************************/
+static void bench(const char *name, int kind)
+{
+	static uint32_t words[BLOCK / 2];
+	static uint16_t values[BLOCK];
+	const int blocks = 20000;
+	uint16_t level = 2048;
+	int sink = 0;
+
+	/* A flat signal never at the level never trigs */
+	do
+		fill(words, BLOCK, kind, level);
+	while(kind == 0 && (words[0] & 0xfff) == level);
+
+	double t0 = now();
+
+	for(int i = 0; i < blocks; i++)
+	{
+		unpack_bytes(values, words, BLOCK);
+		sink += search_any(values, BLOCK, values[0], level);
+		__asm__ volatile("" : : "r"(values) : "memory");
+	}
+
+	double t1 = now();
+
+	for(int i = 0; i < blocks; i++)
+	{
+		struct adc_trig trig = { .mode = ADC_TRIG_ANY, .level = level };
+
+		adc_trig_reset(&trig, words[0] >> 16 & 0xfff);
+		sink += adc_unpack_trig(&trig, values, words, BLOCK);
+		__asm__ volatile("" : : "r"(values) : "memory");
+	}
+
+	double t2 = now();
+
+	printf("%-6s byte at a time %7.0f ns, kernel %7.0f ns per buffer (%d)\n",
+	       name, (t1 - t0) * 1e9 / blocks, (t2 - t1) * 1e9 / blocks, sink != 0);
+}
+
+int main()
+{
+	for(int mode = ADC_TRIG_ANY; mode <= ADC_TRIG_NARROWER; mode++)
+		for(int run = 0; run < 50; run++)
+			test_mode(mode, 200);
+
+	printf("%s, %d failures\n", failures ? "FAIL" : "OK", failures);
+
+	bench("flat", 0);
+	bench("noise", 2);
+
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,211 @@
+/*
+ *  This file is part of SWT21 lab kit firmware.
+ *
+ *  SWT21 lab kit firmware is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  SWT21 lab kit firmware is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with SWT21 lab kit firmware.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ *  Copyright 2021 Joachim Lublin, Binäs Teknik AB
+ */
+
+/*
+ * Host benchmark of CAN RX text records. The old path made one printf per
+ * field and data byte, each going through hci_print_str(), vsnprintf() into
+ * a 1 KB buffer and a write. The current path builds the record with fmt and
+ * writes it once. Both write to a sink standing in for the TX ring, and the
+ * records are checked to be equal.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+
+#include "fmt.h"
+
+#define FRAMES 1000000
+
+/* Bytes written, as the TX ring would get them */
+static char sink[64];
+static int sink_len;
+static int writes;
+
+struct frame
+{
+	uint32_t identifier;
+	int rtr;
+	uint8_t length;
+	uint8_t data[8];
+};
+
+static double now()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void hci_write(const char *data, int len)
+{
+	if(sink_len + len <= (int)sizeof(sink))
+	{
+		memcpy(&sink[sink_len], data, len);
+		sink_len += len;
+	}
+
+	writes += 1;
+}
+
+/* hci_print_str() without tags, which the RX thread does not set */
+static void __attribute__((noinline)) hci_print_str(const char *format, ...)
+{
+	va_list arglist;
+	va_start(arglist, format);
+
+	char buf[1024];
+
+	vsnprintf(buf, 1023, format, arglist);
+	buf[1023] = 0;
+
+	va_end(arglist);
+
+	hci_write(buf, strlen(buf));
+}
+
+/*******************************************************************************
+ * The RX record as it was printed before fmt
+ ******************************************************************************/
+static void rx_printf(uint64_t time, const struct frame *msg)
+{
+	hci_print_str("@%llu CAN RX: %x#", (unsigned long long)time, msg->identifier);
+
+	if(msg->rtr)
+		hci_print_str("R");
+	else
+		for(int i = 0; i < msg->length; i++)
+			hci_print_str("%02x", msg->data[i]);
+
+	hci_print_str("\n");
+}
+
+/*******************************************************************************
+ * The RX record as can_format_rx() builds it
+ ******************************************************************************/
+static void rx_fmt(uint64_t time, const struct frame *msg)
+{
+	char buf[64];
+	char *p = fmt_timestamp(buf, time);
+
+	p = fmt_str(p, "CAN RX: ");
+
+	p = fmt_hex32(p, msg->identifier);
+	*p++ = '#';
+
+	if(msg->rtr)
+		*p++ = 'R';
+	else
+		p = fmt_hex(p, msg->data, msg->length <= 8 ? msg->length : 8);
+
+	*p++ = '\n';
+
+	hci_write(buf, p - buf);
+}
+
+static void next_frame(struct frame *msg, uint32_t *seed)
+{
+	*seed = *seed * 1103515245 + 12345;
+
+	msg->identifier = *seed >> 8 & 0x7ff;
+	msg->rtr = (*seed & 0xf) == 0;
+	msg->length = (*seed >> 4) % 9;
+
+	for(int i = 0; i < 8; i++)
+		msg->data[i] = *seed >> (3 * i);
+}
+
+int main()
+{
+	struct frame msg;
+	uint32_t seed = 1;
+	int failures = 0;
+
+	/* Same text */
+	for(int i = 0; i < 100000; i++)
+	{
+		char expected[sizeof(sink)];
+		uint64_t time = (uint64_t)i * 123457;
+
+		next_frame(&msg, &seed);
+
+		sink_len = 0;
+		rx_printf(time, &msg);
+		memcpy(expected, sink, sink_len);
+		int expected_len = sink_len;
+
+		sink_len = 0;
+		rx_fmt(time, &msg);
+
+		if(sink_len != expected_len || memcmp(sink, expected, sink_len))
+		{
+			if(failures < 10)
+				printf("FAIL %.*s", expected_len, expected);
+
+			failures += 1;
+		}
+	}
+
+	printf("%s, %d failures\n", failures ? "FAIL" : "OK", failures);
+
+	/* 8 byte data frames as streamed from a busy bus */
+	msg = (struct frame)
+	{
+		.identifier = 0x1ff,
+		.length = 8,
+		.data = { 0x01, 0x23, 0x45, 0x67, 0x89, 0xab, 0xcd, 0xef }
+	};
+
+	double t0 = now();
+
+	writes = 0;
+
+	for(int i = 0; i < FRAMES; i++)
+	{
+		msg.identifier = i & 0x7ff;
+		msg.data[0] = i;
+		sink_len = 0;
+		rx_printf(1000000000ull + i, &msg);
+	}
+
+	double t1 = now();
+	int writes_printf = writes;
+
+	writes = 0;
+
+	for(int i = 0; i < FRAMES; i++)
+	{
+		msg.identifier = i & 0x7ff;
+		msg.data[0] = i;
+		sink_len = 0;
+		rx_fmt(1000000000ull + i, &msg);
+	}
+
+	double t2 = now();
+
+	printf("printf %5.0f ns %d writes, fmt %5.0f ns %d writes per frame\n",
+	       (t1 - t0) * 1e9 / FRAMES, writes_printf / FRAMES,
+	       (t2 - t1) * 1e9 / FRAMES, writes / FRAMES);
+
+	return failures ? 1 : 0;
+}